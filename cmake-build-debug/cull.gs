@@ -0,0 +1,35 @@
+#version 330 core
+layout (points) in;
+layout (points, max_vertices = 1) out;
+
+in vec4 Placement[];
+in vec4 Scale[];
+
+// captured by transform feedback, only for the boxes that survive
+out vec4 CulledPlacement;
+out vec4 CulledScale;
+
+uniform vec4 planes[6];       // frustum planes, inside is positive
+uniform vec3 cubeHalfExtent;  // half extent of the unit cube mesh
+uniform vec3 viewPos;
+uniform float margin;         // world units the bounds grow by, the result is drawn a frame later
+uniform float minSize;        // boxes whose radius over distance is smaller are dropped
+
+void main()
+{
+    vec3 centre = Placement[0].xyz;
+    vec3 extent = abs(Scale[0].xyz) * cubeHalfExtent;
+    vec3 grown = extent + vec3(margin);
+    for (int p = 0; p < 6; ++p)
+    {
+        if (dot(planes[p].xyz, centre) + planes[p].w + dot(abs(planes[p].xyz), grown) < 0.0)
+            return;
+    }
+    // distance LOD: too small on screen to be worth drawing
+    if (length(extent) < minSize * distance(centre, viewPos))
+        return;
+    CulledPlacement = Placement[0];
+    CulledScale = Scale[0];
+    EmitVertex();
+    EndPrimitive();
+}
@@ -0,0 +1,12 @@
+#version 330 core
+layout (location = 0) in vec4 aPlacement; // centre, texture
+layout (location = 1) in vec4 aScale;     // scale of the unit cube, w unused
+
+out vec4 Placement;
+out vec4 Scale;
+
+void main()
+{
+    Placement = aPlacement;
+    Scale = aScale;
+}
@@ -0,0 +1,16 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 3) in vec4 aPlacement; // centre, texture
+layout (location = 4) in vec4 aScale;
+
+uniform mat4 view;
+uniform mat4 projection;
+
+// depth prepass of the GPU culled boxes, must match lighting_instanced.vs
+invariant gl_Position;
+
+void main()
+{
+    vec3 FragPos = aPlacement.xyz + aPos * aScale.xyz;
+    gl_Position = projection * view * vec4(FragPos, 1.0);
+}
@@ -5,6 +5,9 @@ uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
 
+// also the depth prepass of boxes, lamp and ground, which are then shaded with GL_EQUAL
+invariant gl_Position;
+
 void main()
 {
 	gl_Position = projection * view * model * vec4(aPos, 1.0);
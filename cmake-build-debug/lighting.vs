@@ -8,14 +8,18 @@ out vec3 FragPos;
 out vec3 Normal;
 
 uniform mat4 model;
+uniform mat3 normalMatrix; // inverse transpose of the model matrix, from the CPU
 uniform mat4 view;
 uniform mat4 projection;
 
+// the depth prepass draws with lamp.vs, the same expression keeps the depths equal
+invariant gl_Position;
+
 void main()
 {
     FragPos = vec3(model * vec4(aPos, 1.0));
-    Normal = mat3(transpose(inverse(model))) * aNormal;  
+    Normal = normalMatrix * aNormal;
     
-    gl_Position = projection * view * vec4(FragPos, 1.0);
+    gl_Position = projection * view * model * vec4(aPos, 1.0);
     TexCoord = vec2(aTexCoord.x, aTexCoord.y);
 }
\ No newline at end of file
@@ -0,0 +1,29 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 2) in vec2 aTexCoord;
+layout (location = 1) in vec3 aNormal;
+layout (location = 3) in vec4 aPlacement; // centre, texture
+layout (location = 4) in vec4 aScale;
+
+out vec2 TexCoord;
+out vec3 FragPos;
+out vec3 Normal;
+flat out int Texture;
+
+uniform mat4 view;
+uniform mat4 projection;
+
+// matches depth_instanced.vs for the depth prepass
+invariant gl_Position;
+
+void main()
+{
+    // boxes are axis aligned: the model matrix is a scale and a translation, and the normal
+    // matrix is the inverse scale
+    FragPos = aPlacement.xyz + aPos * aScale.xyz;
+    Normal = aNormal / aScale.xyz;
+
+    gl_Position = projection * view * vec4(FragPos, 1.0);
+    TexCoord = vec2(aTexCoord.x, aTexCoord.y);
+    Texture = int(aPlacement.w);
+}
@@ -1,6 +1,13 @@
 #version 330 core
 out vec4 FragColor;
+
+in vec2 Corner;
+
+uniform float opacity;
+
 void main()
 {
-    FragColor = vec4(0.7f);
+    // round, soft-edged puff instead of a hard square
+    float fade = 1.0 - smoothstep(0.25, 0.5, length(Corner));
+    FragColor = vec4(vec3(0.7f), opacity * fade);
 }
\ No newline at end of file
@@ -1,11 +1,18 @@
 #version 330 core
-layout (location = 0) in vec3 aPos;
+layout (location = 0) in vec2 aCorner;   // quad corner in [-0.5, 0.5]
+layout (location = 3) in vec4 aInstance; // xyz = particle centre, w = size
+
+out vec2 Corner;
 
-uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
+uniform vec3 cameraRight;
+uniform vec3 cameraUp;
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
-}
\ No newline at end of file
+    // expand the corner in the camera plane so the quad always faces the viewer
+    vec3 pos = aInstance.xyz + (cameraRight * aCorner.x + cameraUp * aCorner.y) * aInstance.w;
+    gl_Position = projection * view * vec4(pos, 1.0);
+    Corner = aCorner;
+}
@@ -0,0 +1,40 @@
+#version 330 core
+out vec4 FragColor;
+
+uniform sampler2D particles;     // premultiplied color, coverage in alpha
+uniform sampler2D particleDepth; // the downsampled depth the particles were tested against
+uniform sampler2D sceneDepth;
+uniform int divisor;
+uniform ivec2 particleMax;       // last particle texel drawn this frame
+uniform vec2 depthUnproject;     // projection[2][2] and projection[3][2]
+
+// distance from the camera of a depth buffer value
+float linearDepth(float depth)
+{
+    return depthUnproject.y / (depth * 2.0 - 1.0 + depthUnproject.x);
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = linearDepth(texelFetch(sceneDepth, pixel, 0).r);
+
+    // the four particle texels around this pixel, weighted bilinearly and by how close their
+    // depth is to the pixel's, so the particles do not bleed across silhouettes
+    vec2 position = (vec2(pixel) + 0.5) / float(divisor) - 0.5;
+    ivec2 base = ivec2(floor(position));
+    vec2 fraction = position - vec2(base);
+    vec4 sum = vec4(0.0);
+    float total = 0.0;
+    for (int i = 0; i < 4; ++i)
+    {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 texel = clamp(base + offset, ivec2(0), particleMax);
+        vec2 bilinear = mix(1.0 - fraction, fraction, vec2(offset));
+        float difference = abs(linearDepth(texelFetch(particleDepth, texel, 0).r) - depth) / depth;
+        float weight = bilinear.x * bilinear.y / (difference + 0.01);
+        sum += texelFetch(particles, texel, 0) * weight;
+        total += weight;
+    }
+    FragColor = sum / max(total, 1e-6);
+}
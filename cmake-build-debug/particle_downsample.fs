@@ -0,0 +1,16 @@
+#version 330 core
+uniform sampler2D sceneDepth;
+uniform int divisor;     // scene pixels per particle pixel, per axis
+uniform ivec2 sceneMax;  // last scene texel drawn this frame
+
+void main()
+{
+    // nearest depth of the block: particles behind any of its pixels are dropped, which keeps
+    // them from showing through the edges of the boxes
+    ivec2 base = ivec2(gl_FragCoord.xy) * divisor;
+    float depth = 1.0;
+    for (int y = 0; y < divisor; ++y)
+        for (int x = 0; x < divisor; ++x)
+            depth = min(depth, texelFetch(sceneDepth, min(base + ivec2(x, y), sceneMax), 0).r);
+    gl_FragDepth = depth;
+}
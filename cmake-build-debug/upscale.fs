@@ -0,0 +1,12 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoord;
+
+uniform sampler2D scene;
+uniform vec2 uvMax; // last texel centre drawn this frame, the rest holds older frames
+
+void main()
+{
+    FragColor = texture(scene, min(TexCoord, uvMax));
+}
@@ -0,0 +1,12 @@
+#version 330 core
+out vec2 TexCoord;
+
+uniform vec2 uvScale; // part of the target the scene was drawn into
+
+void main()
+{
+    // one triangle covering the screen, corners from the vertex index
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    TexCoord = corner * uvScale;
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
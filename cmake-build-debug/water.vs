@@ -1,11 +1,22 @@
 #version 330 core
-layout (location = 0) in vec3 aPos;
+layout (location = 0) in vec2 aCorner;   // quad corner in [-0.5, 0.5]
+layout (location = 3) in vec4 aInstance; // xyz = drop centre, w = fall speed
 
-uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
+uniform vec3 viewPos;
+uniform vec3 cameraRight;
+uniform float streakWidth;
+uniform float streakLength; // length of the streak per unit of speed
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
-}
\ No newline at end of file
+    // the streak runs along the velocity and is turned around it to face the camera
+    vec3 axis = vec3(0.0, -1.0, 0.0);
+    vec3 side = cross(axis, viewPos - aInstance.xyz);
+    // looking straight along the fall direction leaves no side vector, fall back to the camera's
+    side = dot(side, side) > 1e-6 ? normalize(side) : cameraRight;
+
+    vec3 pos = aInstance.xyz + side * (aCorner.x * streakWidth) + axis * (aCorner.y * aInstance.w * streakLength);
+    gl_Position = projection * view * vec4(pos, 1.0);
+}
@@ -0,0 +1,27 @@
+#include "helper/frame_arena.h"
+
+// Replaces the global allocation functions so debug builds can count heap allocations per
+// thread, see HeapCheck in helper/frame_arena.h. The replacements may only be defined once in
+// the program, so they live here rather than in the header; release builds keep the
+// library's own.
+#ifndef NDEBUG
+void* operator new(std::size_t size)
+{
+    HeapCheck &check = ThreadHeapCheck();
+    if (check.Active)
+        ++check.Count;
+    if (void *memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+#endif
@@ -0,0 +1,443 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <glm/glm.hpp>
+
+#include "job_system.h"
+#include "scene_store.h"
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+// A ray for Bvh queries; hits further than MaxDistance are ignored
+struct Ray
+{
+    glm::vec3 Origin;
+    glm::vec3 Direction;
+    float MaxDistance;
+};
+
+// Closest box a ray hits, Box is -1 when it hits none
+struct RayHit
+{
+    int Box;
+    float Distance;
+};
+
+// Node of the hierarchy. Inner nodes have Count 0 and their children at First and First + 1,
+// leaves cover Count boxes starting at First in the Bvh's index list.
+struct BvhNode
+{
+    glm::vec3 Min, Max;
+    unsigned int First;
+    unsigned int Count;
+
+    bool IsLeaf() const { return Count > 0; }
+};
+
+// Bounding volume hierarchy over the scene's boxes, built top down with a binned surface area
+// heuristic. Moving boxes are handled by refitting the bounds bottom up, which keeps the tree
+// valid but slowly degrades it; the tree is rebuilt once its SAH cost has grown by
+// REBUILD_COST_RATIO over the cost it was built with, or after MAX_REFITS refits. Like the
+// other derived structures it catches up with scene edits through the change log.
+class Bvh
+{
+public:
+    static const unsigned int BINS = 12;
+    static const unsigned int MAX_LEAF_SIZE = 4;
+    static const unsigned int MAX_REFITS = 600;
+    static const unsigned int MAX_DEPTH = 64;
+    static constexpr float REBUILD_COST_RATIO = 1.5f;
+
+    Bvh() : builtCost(0.0f), refits(0), builds(0), sceneVersion(0)
+    {
+    }
+
+    const std::vector<BvhNode>& Nodes() const { return nodes; }
+    // box indices in leaf order, leaves refer to ranges of it
+    const std::vector<unsigned int>& Indices() const { return indices; }
+    // incremented by every (re)build; node indices are only stable between builds
+    unsigned int Builds() const { return builds; }
+
+    void Rebuild(const SceneStore &scene)
+    {
+        boxMin.resize(scene.Size());
+        boxMax.resize(scene.Size());
+        for (unsigned int i = 0; i < scene.Size(); ++i)
+        {
+            boxMin[i] = scene[i].Min();
+            boxMax[i] = scene[i].Max();
+        }
+        build();
+        sceneVersion = scene.Version();
+    }
+
+    // Catches up with the edits made since the last Rebuild() or Update(): moved boxes are
+    // refitted, added boxes or a degraded tree trigger a rebuild
+    void Update(const SceneStore &scene)
+    {
+        if (scene.Version() == sceneVersion)
+            return;
+        pending.clear();
+        if (scene.Size() != boxMin.size() || !scene.ChangesSince(sceneVersion, pending))
+        {
+            Rebuild(scene);
+            return;
+        }
+        for (unsigned int c = 0; c < pending.size(); ++c)
+        {
+            boxMin[pending[c].Index] = scene[pending[c].Index].Min();
+            boxMax[pending[c].Index] = scene[pending[c].Index].Max();
+        }
+        Refit();
+        if (refits > MAX_REFITS || cost() > builtCost * REBUILD_COST_RATIO)
+            build();
+        sceneVersion = scene.Version();
+    }
+
+    // Recomputes every node's bounds from the boxes, keeping the tree's shape
+    void Refit()
+    {
+        // children are always stored after their parent, so a reverse sweep sees them first
+        for (unsigned int n = (unsigned int)nodes.size(); n-- > 0; )
+        {
+            BvhNode &node = nodes[n];
+            if (node.IsLeaf())
+                leafBounds(node);
+            else
+            {
+                node.Min = glm::min(nodes[node.First].Min, nodes[node.First + 1].Min);
+                node.Max = glm::max(nodes[node.First].Max, nodes[node.First + 1].Max);
+            }
+        }
+        ++refits;
+    }
+
+    // Splits the boxes into groups of at most maxBoxes, each the subtree of one node, for
+    // per-group work such as occlusion queries. groups receives the node of every group and
+    // groupOf the group of every box. Groups only change when the tree is rebuilt.
+    void Cut(unsigned int maxBoxes, std::vector<unsigned int> &groups, std::vector<int> &groupOf) const
+    {
+        groups.clear();
+        groupOf.assign(boxMin.size(), -1);
+        if (nodes.empty())
+            return;
+        // every subtree covers a contiguous range of indices; children come after their parent
+        std::vector<unsigned int> rangeFirst(nodes.size()), rangeCount(nodes.size());
+        for (unsigned int n = (unsigned int)nodes.size(); n-- > 0; )
+        {
+            const BvhNode &node = nodes[n];
+            rangeFirst[n] = node.IsLeaf() ? node.First : rangeFirst[node.First];
+            rangeCount[n] = node.IsLeaf() ? node.Count : rangeCount[node.First] + rangeCount[node.First + 1];
+        }
+        unsigned int stack[MAX_DEPTH];
+        unsigned int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            unsigned int n = stack[--top];
+            if (!nodes[n].IsLeaf() && rangeCount[n] > maxBoxes)
+            {
+                stack[top++] = nodes[n].First + 1;
+                stack[top++] = nodes[n].First;
+                continue;
+            }
+            for (unsigned int i = rangeFirst[n]; i < rangeFirst[n] + rangeCount[n]; ++i)
+                groupOf[indices[i]] = (int)groups.size();
+            groups.push_back(n);
+        }
+    }
+
+    // Closest box along the ray
+    RayHit Intersect(const Ray &ray) const
+    {
+        RayHit hit;
+        hit.Box = -1;
+        hit.Distance = ray.MaxDistance;
+        if (nodes.empty())
+            return hit;
+
+        glm::vec3 inverse = 1.0f / ray.Direction;
+        unsigned int stack[MAX_DEPTH];
+        unsigned int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const BvhNode &node = nodes[stack[--top]];
+            if (slab(ray.Origin, inverse, node.Min, node.Max) >= hit.Distance)
+                continue;
+            if (node.IsLeaf())
+            {
+                for (unsigned int i = node.First; i < node.First + node.Count; ++i)
+                {
+                    float distance = slab(ray.Origin, inverse, boxMin[indices[i]], boxMax[indices[i]]);
+                    if (distance < hit.Distance)
+                    {
+                        hit.Box = (int)indices[i];
+                        hit.Distance = distance;
+                    }
+                }
+                continue;
+            }
+            // the nearer child goes on top of the stack so it is visited first and shortens the ray
+            float nearLeft = slab(ray.Origin, inverse, nodes[node.First].Min, nodes[node.First].Max);
+            float nearRight = slab(ray.Origin, inverse, nodes[node.First + 1].Min, nodes[node.First + 1].Max);
+            unsigned int first = node.First, second = node.First + 1;
+            if (nearRight < nearLeft)
+            {
+                std::swap(first, second);
+                std::swap(nearLeft, nearRight);
+            }
+            if (nearRight < hit.Distance)
+                stack[top++] = second;
+            if (nearLeft < hit.Distance)
+                stack[top++] = first;
+        }
+        return hit;
+    }
+
+    // Intersects every ray, split across the job system's workers; hits is resized to match
+    void Intersect(const std::vector<Ray> &rays, std::vector<RayHit> &hits, JobSystem &jobs) const
+    {
+        hits.resize(rays.size());
+        jobs.ParallelFor(0, (unsigned int)rays.size(), RAY_GRAIN, [&](unsigned int begin, unsigned int end) {
+            for (unsigned int r = begin; r < end; ++r)
+                hits[r] = Intersect(rays[r]);
+        });
+    }
+
+    // Appends every box whose bounds overlap [min, max] to out
+    void Overlap(glm::vec3 min, glm::vec3 max, std::vector<unsigned int> &out) const
+    {
+        if (nodes.empty())
+            return;
+        unsigned int stack[MAX_DEPTH];
+        unsigned int top = 0;
+        stack[top++] = 0;
+        while (top > 0)
+        {
+            const BvhNode &node = nodes[stack[--top]];
+            if (!overlaps(node.Min, node.Max, min, max))
+                continue;
+            if (!node.IsLeaf())
+            {
+                stack[top++] = node.First + 1;
+                stack[top++] = node.First;
+                continue;
+            }
+            for (unsigned int i = node.First; i < node.First + node.Count; ++i)
+                if (overlaps(boxMin[indices[i]], boxMax[indices[i]], min, max))
+                    out.push_back(indices[i]);
+        }
+    }
+
+    // Runs Overlap() for every query box, split across the workers; out[q] receives the boxes
+    // overlapping query q
+    void Overlap(const std::vector<glm::vec3> &mins, const std::vector<glm::vec3> &maxs, std::vector<std::vector<unsigned int> > &out, JobSystem &jobs) const
+    {
+        out.resize(mins.size());
+        jobs.ParallelFor(0, (unsigned int)mins.size(), RAY_GRAIN, [&](unsigned int begin, unsigned int end) {
+            for (unsigned int q = begin; q < end; ++q)
+            {
+                out[q].clear();
+                Overlap(mins[q], maxs[q], out[q]);
+            }
+        });
+    }
+
+private:
+    static const unsigned int RAY_GRAIN = 64;
+
+    std::vector<BvhNode> nodes;
+    std::vector<unsigned int> indices;
+    std::vector<glm::vec3> boxMin, boxMax, centroid;
+    std::vector<SceneChange> pending;
+    float builtCost;
+    unsigned int refits, builds;
+    unsigned long sceneVersion;
+
+    struct Bin
+    {
+        glm::vec3 Min, Max;
+        unsigned int Count;
+    };
+
+    static float area(glm::vec3 min, glm::vec3 max)
+    {
+        glm::vec3 size = glm::max(max - min, glm::vec3(0.0f));
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+
+    static bool overlaps(glm::vec3 aMin, glm::vec3 aMax, glm::vec3 bMin, glm::vec3 bMax)
+    {
+        return aMin.x <= bMax.x && aMax.x >= bMin.x && aMin.y <= bMax.y && aMax.y >= bMin.y && aMin.z <= bMax.z && aMax.z >= bMin.z;
+    }
+
+    // Distance at which the ray enters [min, max], or infinity when it misses; a ray starting
+    // inside enters at 0
+    static float slab(glm::vec3 origin, glm::vec3 inverse, glm::vec3 min, glm::vec3 max)
+    {
+        glm::vec3 t0 = (min - origin) * inverse;
+        glm::vec3 t1 = (max - origin) * inverse;
+        glm::vec3 tNear = glm::min(t0, t1), tFar = glm::max(t0, t1);
+        float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+        float exit = std::min(std::min(tFar.x, tFar.y), tFar.z);
+        return enter <= exit ? enter : std::numeric_limits<float>::infinity();
+    }
+
+    void leafBounds(BvhNode &node) const
+    {
+        node.Min = glm::vec3(std::numeric_limits<float>::max());
+        node.Max = glm::vec3(-std::numeric_limits<float>::max());
+        for (unsigned int i = node.First; i < node.First + node.Count; ++i)
+        {
+            node.Min = glm::min(node.Min, boxMin[indices[i]]);
+            node.Max = glm::max(node.Max, boxMax[indices[i]]);
+        }
+    }
+
+    void build()
+    {
+        unsigned int n = (unsigned int)boxMin.size();
+        nodes.clear();
+        indices.resize(n);
+        centroid.resize(n);
+        for (unsigned int i = 0; i < n; ++i)
+        {
+            indices[i] = i;
+            centroid[i] = (boxMin[i] + boxMax[i]) * 0.5f;
+        }
+        refits = 0;
+        builds++;
+        builtCost = 0.0f;
+        if (n == 0)
+            return;
+        nodes.reserve(2 * n);
+        BvhNode root;
+        root.First = 0;
+        root.Count = n;
+        nodes.push_back(root);
+        split(0, 1);
+        builtCost = cost();
+    }
+
+    // Splits node at the cheapest of the binned candidate planes, or leaves it a leaf when no
+    // split beats intersecting all of its boxes
+    void split(unsigned int index, unsigned int depth)
+    {
+        leafBounds(nodes[index]);
+        BvhNode node = nodes[index];
+        if (node.Count <= MAX_LEAF_SIZE || depth >= MAX_DEPTH - 1)
+            return;
+
+        glm::vec3 lo(std::numeric_limits<float>::max()), hi(-std::numeric_limits<float>::max());
+        for (unsigned int i = node.First; i < node.First + node.Count; ++i)
+        {
+            lo = glm::min(lo, centroid[indices[i]]);
+            hi = glm::max(hi, centroid[indices[i]]);
+        }
+
+        float bestCost = std::numeric_limits<float>::max();
+        int bestAxis = -1;
+        unsigned int bestBin = 0;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (hi[axis] <= lo[axis])
+                continue;
+            Bin bins[BINS];
+            for (unsigned int b = 0; b < BINS; ++b)
+            {
+                bins[b].Min = glm::vec3(std::numeric_limits<float>::max());
+                bins[b].Max = glm::vec3(-std::numeric_limits<float>::max());
+                bins[b].Count = 0;
+            }
+            float scale = BINS / (hi[axis] - lo[axis]);
+            for (unsigned int i = node.First; i < node.First + node.Count; ++i)
+            {
+                unsigned int box = indices[i];
+                unsigned int b = std::min(BINS - 1, (unsigned int)((centroid[box][axis] - lo[axis]) * scale));
+                bins[b].Min = glm::min(bins[b].Min, boxMin[box]);
+                bins[b].Max = glm::max(bins[b].Max, boxMax[box]);
+                bins[b].Count++;
+            }
+            // sweep from the right to get the right side of every plane, then from the left
+            float rightArea[BINS];
+            unsigned int rightCount[BINS];
+            glm::vec3 rMin(std::numeric_limits<float>::max()), rMax(-std::numeric_limits<float>::max());
+            unsigned int count = 0;
+            for (unsigned int b = BINS - 1; b > 0; --b)
+            {
+                rMin = glm::min(rMin, bins[b].Min);
+                rMax = glm::max(rMax, bins[b].Max);
+                count += bins[b].Count;
+                rightArea[b] = count ? area(rMin, rMax) : 0.0f;
+                rightCount[b] = count;
+            }
+            glm::vec3 lMin(std::numeric_limits<float>::max()), lMax(-std::numeric_limits<float>::max());
+            count = 0;
+            for (unsigned int b = 0; b < BINS - 1; ++b)
+            {
+                lMin = glm::min(lMin, bins[b].Min);
+                lMax = glm::max(lMax, bins[b].Max);
+                count += bins[b].Count;
+                if (count == 0 || rightCount[b + 1] == 0)
+                    continue;
+                float candidate = area(lMin, lMax) * count + rightArea[b + 1] * rightCount[b + 1];
+                if (candidate < bestCost)
+                {
+                    bestCost = candidate;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        // compare with intersecting every box of the node, one traversal step costing about one box
+        float leafCost = area(node.Min, node.Max) * node.Count;
+        if (bestAxis >= 0 && area(node.Min, node.Max) + bestCost >= leafCost)
+            return;
+        // when every centroid coincides there is no plane to bin by, the range is halved instead
+        if (bestAxis < 0 && node.Count <= MAX_LEAF_SIZE * 4)
+            return;
+
+        unsigned int middle;
+        if (bestAxis >= 0)
+        {
+            float scale = BINS / (hi[bestAxis] - lo[bestAxis]);
+            unsigned int *first = &indices[node.First];
+            unsigned int *last = first + node.Count;
+            middle = (unsigned int)(std::partition(first, last, [&](unsigned int box) {
+                return std::min(BINS - 1, (unsigned int)((centroid[box][bestAxis] - lo[bestAxis]) * scale)) <= bestBin;
+            }) - &indices[0]);
+        }
+        else
+            middle = node.First + node.Count / 2;
+
+        unsigned int left = (unsigned int)nodes.size();
+        BvhNode child;
+        child.First = node.First;
+        child.Count = middle - node.First;
+        nodes.push_back(child);
+        child.First = middle;
+        child.Count = node.First + node.Count - middle;
+        nodes.push_back(child);
+        nodes[index].First = left;
+        nodes[index].Count = 0;
+        split(left, depth + 1);
+        split(left + 1, depth + 1);
+    }
+
+    // Surface area heuristic cost of the tree relative to its root
+    float cost() const
+    {
+        if (nodes.empty())
+            return 0.0f;
+        float total = 0.0f;
+        for (unsigned int n = 0; n < nodes.size(); ++n)
+            total += area(nodes[n].Min, nodes[n].Max) * (nodes[n].IsLeaf() ? nodes[n].Count : 1);
+        return total / std::max(area(nodes[0].Min, nodes[0].Max), 1e-6f);
+    }
+};
+
+#endif
@@ -5,6 +5,8 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "frustum.h"
+
 #include <vector>
 
 // Defines several possible options for camera movement. Used as abstraction to stay away from window-system specific input methods
@@ -21,9 +23,13 @@ const float PITCH       =  0.0f;
 const float SPEED       =  10.0f;
 const float SENSITIVITY =  0.1f;
 const float ZOOM        =  45.0f;
+const float NEAR_CLIP   =  0.1f;
+const float FAR_CLIP    =  100.0f;
 
 
-// An abstract camera class that processes input and calculates the corresponding Euler Angles, Vectors and Matrices for use in OpenGL
+// An abstract camera class that processes input and calculates the corresponding Euler Angles, Vectors and Matrices for use in OpenGL.
+// The matrices and frustum planes are cached and only rebuilt after the camera moved, turned, zoomed or the viewport changed,
+// so the attributes should only be changed through the Process functions and SetViewport.
 class Camera
 {
 public:
@@ -42,7 +48,7 @@ public:
     float Zoom;
 
     // Constructor with vectors
-    Camera(glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f), float yaw = YAW, float pitch = PITCH) : Front(glm::vec3(0.0f, 0.0f, -1.0f)), MovementSpeed(SPEED), MouseSensitivity(SENSITIVITY), Zoom(ZOOM)
+    Camera(glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f), float yaw = YAW, float pitch = PITCH) : Front(glm::vec3(0.0f, 0.0f, -1.0f)), MovementSpeed(SPEED), MouseSensitivity(SENSITIVITY), Zoom(ZOOM), aspect(4.0f / 3.0f), viewDirty(true), projectionDirty(true), combinedDirty(true)
     {
         Position = position;
         WorldUp = up;
@@ -51,7 +57,7 @@ public:
         updateCameraVectors();
     }
     // Constructor with scalar values
-    Camera(float posX, float posY, float posZ, float upX, float upY, float upZ, float yaw, float pitch) : Front(glm::vec3(0.0f, 0.0f, -1.0f)), MovementSpeed(SPEED), MouseSensitivity(SENSITIVITY), Zoom(ZOOM)
+    Camera(float posX, float posY, float posZ, float upX, float upY, float upZ, float yaw, float pitch) : Front(glm::vec3(0.0f, 0.0f, -1.0f)), MovementSpeed(SPEED), MouseSensitivity(SENSITIVITY), Zoom(ZOOM), aspect(4.0f / 3.0f), viewDirty(true), projectionDirty(true), combinedDirty(true)
     {
         Position = glm::vec3(posX, posY, posZ);
         WorldUp = glm::vec3(upX, upY, upZ);
@@ -61,9 +67,54 @@ public:
     }
 
     // Returns the view matrix calculated using Euler Angles and the LookAt Matrix
-    glm::mat4 GetViewMatrix()
+    const glm::mat4& GetViewMatrix()
+    {
+        if (viewDirty)
+        {
+            view = glm::lookAt(Position, Position + Front, Up);
+            viewDirty = false;
+            combinedDirty = true;
+        }
+        return view;
+    }
+
+    // Returns the perspective projection for Zoom and the viewport's aspect ratio
+    const glm::mat4& GetProjectionMatrix()
     {
-        return glm::lookAt(Position, Position + Front, Up);
+        if (projectionDirty)
+        {
+            projection = glm::perspective(glm::radians(Zoom), aspect, NEAR_CLIP, FAR_CLIP);
+            projectionDirty = false;
+            combinedDirty = true;
+        }
+        return projection;
+    }
+
+    // Returns projection * view
+    const glm::mat4& GetViewProjectionMatrix()
+    {
+        updateCombined();
+        return viewProjection;
+    }
+
+    // Returns the planes of the view frustum
+    const Frustum& GetFrustum()
+    {
+        updateCombined();
+        return frustum;
+    }
+
+    // Takes the aspect ratio of the framebuffer; an empty one (a minimized window) keeps the last
+    void SetViewport(int width, int height)
+    {
+        if (width <= 0 || height <= 0)
+            return;
+        float ratio = (float)width / (float)height;
+        if (ratio != aspect)
+        {
+            aspect = ratio;
+            projectionDirty = true;
+        }
     }
 
     // Processes input received from any keyboard-like input system. Accepts input parameter in the form of camera defined ENUM (to abstract it from windowing systems)
@@ -78,6 +129,7 @@ public:
             Position -= Right * velocity;
         if (direction == RIGHT)
             Position += Right * velocity;
+        viewDirty = true;
     }
 
     // Processes input received from a mouse input system. Expects the offset value in both the x and y direction.
@@ -111,9 +163,27 @@ public:
             Zoom = 1.0f;
         if (Zoom >= 45.0f)
             Zoom = 45.0f;
+        projectionDirty = true;
     }
 
 private:
+    glm::mat4 view, projection, viewProjection;
+    Frustum frustum;
+    float aspect;
+    bool viewDirty, projectionDirty, combinedDirty;
+
+    // Rebuilds projection * view and the frustum after either matrix changed
+    void updateCombined()
+    {
+        GetViewMatrix();
+        GetProjectionMatrix();
+        if (!combinedDirty)
+            return;
+        viewProjection = projection * view;
+        frustum = Frustum::FromMatrix(viewProjection);
+        combinedDirty = false;
+    }
+
     // Calculates the front vector from the Camera's (updated) Euler Angles
     void updateCameraVectors()
     {
@@ -126,6 +196,7 @@ private:
         // Also re-calculate the Right and Up vector
         Right = glm::normalize(glm::cross(Front, WorldUp));  // Normalize the vectors, because their length gets closer to 0 the more you look up or down which results in slower movement.
         Up    = glm::normalize(glm::cross(Right, Front));
+        viewDirty = true;
     }
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,96 @@
+#ifndef DRAW_LIST_H
+#define DRAW_LIST_H
+
+#include <glm/glm.hpp>
+
+#include "job_system.h"
+#include "radix_sort.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+// One recorded draw call: the pass selects shader and state on replay, the rest is the data of
+// the call itself. Instances is 0 for a single draw and the instance count otherwise. Group is
+// the occlusion group the draw is skipped with, -1 when it is always drawn. Normal is the
+// inverse transpose of Model's upper 3x3, worked out when the packet is recorded.
+struct DrawPacket
+{
+    uint64_t Key;
+    unsigned int Pass;
+    int Texture;
+    int Group;
+    unsigned int Instances;
+    glm::mat4 Model;
+    glm::mat3 Normal;
+    glm::vec3 Color;
+};
+
+// Coarse distance band of a view depth: [0, 1), [1, 3), [3, 7), ... each band twice as deep as
+// the one before, the last one open ended
+inline unsigned int DepthBand(float depth)
+{
+    unsigned int band = 0;
+    for (float end = 1.0f; depth >= end && band < 15; end = end * 2.0f + 1.0f)
+        ++band;
+    return band;
+}
+
+// Sort key: pass first so state changes happen once per pass, then the depth band so opaque
+// draws go roughly front to back, then texture so a bound texture serves a run of draws within
+// a band, then exact depth
+inline uint64_t MakeDrawKey(unsigned int pass, unsigned int texture, float depth)
+{
+    return ((uint64_t)(pass & 0xFF) << 56) | ((uint64_t)DepthBand(depth) << 52) | ((uint64_t)(texture & 0xFF) << 44) |
+           ((uint64_t)FloatToSortableKey(depth) << 12);
+}
+
+// Draw packets recorded by many threads at once. Each job system thread appends to its own
+// list, so recording takes no locks; the GL thread merges the lists into one key-sorted order
+// and replays it. Lists keep their capacity when cleared.
+class DrawListSet
+{
+public:
+    DrawListSet() : lists(JobSystem::MAX_THREADS)
+    {
+    }
+
+    void Clear()
+    {
+        for (unsigned int i = 0; i < lists.size(); ++i)
+            lists[i].Packets.clear();
+    }
+
+    // The calling thread's list
+    std::vector<DrawPacket>& Local(JobSystem &jobs)
+    {
+        return lists[jobs.ThreadIndex()].Packets;
+    }
+
+    // Every recorded packet, ordered by key; order is any vector of const DrawPacket*
+    template <typename Vector>
+    void Merge(Vector &order) const
+    {
+        size_t total = 0;
+        for (unsigned int i = 0; i < lists.size(); ++i)
+            total += lists[i].Packets.size();
+        order.clear();
+        order.reserve(total);
+        for (unsigned int i = 0; i < lists.size(); ++i)
+            for (unsigned int j = 0; j < lists[i].Packets.size(); ++j)
+                order.push_back(&lists[i].Packets[j]);
+        std::sort(order.begin(), order.end(), [](const DrawPacket *a, const DrawPacket *b) { return a->Key < b->Key; });
+    }
+
+private:
+    // padded so threads appending to neighbouring lists do not share a cache line
+    struct ThreadList
+    {
+        std::vector<DrawPacket> Packets;
+        char padding[64 - sizeof(std::vector<DrawPacket>) % 64];
+    };
+
+    std::vector<ThreadList> lists;
+};
+
+#endif
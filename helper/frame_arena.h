@@ -0,0 +1,169 @@
+#ifndef FRAME_ARENA_H
+#define FRAME_ARENA_H
+
+#include "job_system.h"
+
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+// Global operator new calls made by one thread inside its current check, between
+// BeginHeapCheck() and EndHeapCheck(). They are only counted in debug builds, where
+// heap_check.cpp replaces operator new; main.cpp then defines FRAME_ARENA_COUNT_HEAP and wraps
+// the frames of the simulation and render threads in checks to find the ones that still
+// allocate, while other threads and the work between frames are left out.
+struct HeapCheck
+{
+    bool Active;
+    unsigned long long Count;
+};
+
+inline HeapCheck& ThreadHeapCheck()
+{
+    static thread_local HeapCheck check = { false, 0 };
+    return check;
+}
+
+inline void BeginHeapCheck()
+{
+    ThreadHeapCheck().Count = 0;
+    ThreadHeapCheck().Active = true;
+}
+
+// Ends the calling thread's check and returns the allocations it made during it
+inline unsigned long long EndHeapCheck()
+{
+    ThreadHeapCheck().Active = false;
+    return ThreadHeapCheck().Count;
+}
+
+// Linear allocator for data that lives for one frame. Allocate() bumps a pointer through one
+// block; Reset() at frame start releases everything at once, nothing is freed individually.
+// When a frame needs more than the block holds the rest comes from the heap, and the next
+// Reset() grows the block so later frames fit again without allocating. Not thread safe:
+// every thread allocates from its own arena, see FrameArenaSet.
+class FrameArena
+{
+public:
+    explicit FrameArena(size_t capacity) : block(NULL), capacity(capacity), used(0), highWater(0), overflow(0)
+    {
+    }
+
+    ~FrameArena()
+    {
+        release();
+        ::operator delete(block);
+    }
+
+    void* Allocate(size_t bytes, size_t alignment = alignof(std::max_align_t))
+    {
+        if (block == NULL)
+            block = (unsigned char*)::operator new(capacity);
+        size_t start = (used + alignment - 1) & ~(alignment - 1);
+        if (start + bytes <= capacity)
+        {
+            used = start + bytes;
+            highWater = std::max(highWater, used);
+            return block + start;
+        }
+        // out of room for this frame; remember how much was asked for so Reset() can grow
+        overflow += bytes + alignment;
+        void *memory = ::operator new(bytes + alignment);
+        spilled.push_back(memory);
+        return (void*)(((uintptr_t)memory + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    }
+
+    void Reset()
+    {
+        if (overflow > 0)
+        {
+            size_t needed = highWater + overflow;
+            release();
+            ::operator delete(block);
+            block = NULL;
+            capacity = std::max(capacity * 2, needed);
+        }
+        used = 0;
+        overflow = 0;
+    }
+
+    size_t Used() const { return used; }
+    size_t Capacity() const { return capacity; }
+    size_t HighWater() const { return highWater; }
+
+private:
+    unsigned char *block;
+    size_t capacity, used, highWater, overflow;
+    std::vector<void*> spilled;
+
+    void release()
+    {
+        for (unsigned int i = 0; i < spilled.size(); ++i)
+            ::operator delete(spilled[i]);
+        spilled.clear();
+    }
+};
+
+// STL allocator over a FrameArena; deallocation is a no-op, memory returns on Reset()
+template <typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(FrameArena &arena) : arena(&arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.Arena()) {}
+
+    T* allocate(size_t n) { return (T*)arena->Allocate(n * sizeof(T), alignof(T)); }
+    void deallocate(T*, size_t) {}
+
+    FrameArena* Arena() const { return arena; }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &other) const { return arena == other.Arena(); }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const { return arena != other.Arena(); }
+
+private:
+    FrameArena *arena;
+};
+
+template <typename T>
+using FrameVector = std::vector<T, ArenaAllocator<T> >;
+
+// One arena per job system thread, so workers allocate transient data without locking.
+// Reset() must only be called while no job is running, at the start of a frame.
+class FrameArenaSet
+{
+public:
+    explicit FrameArenaSet(size_t capacity)
+    {
+        arenas.reserve(JobSystem::MAX_THREADS);
+        for (unsigned int i = 0; i < JobSystem::MAX_THREADS; ++i)
+            arenas.push_back(new FrameArena(capacity));
+    }
+
+    ~FrameArenaSet()
+    {
+        for (unsigned int i = 0; i < arenas.size(); ++i)
+            delete arenas[i];
+    }
+
+    FrameArena& Local(JobSystem &jobs) { return *arenas[jobs.ThreadIndex()]; }
+
+    void Reset()
+    {
+        for (unsigned int i = 0; i < arenas.size(); ++i)
+            arenas[i]->Reset();
+    }
+
+private:
+    std::vector<FrameArena*> arenas; // separate allocations keep neighbours off one cache line
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+enum PacingMode {
+    PACING_UNCAPPED, // poll events, no swap interval: as fast as possible, for benchmarking
+    PACING_VSYNC,    // poll events, swap interval 1: the display paces the frames
+    PACING_FIXED,    // poll events, no swap interval, a limiter holds the target frame rate
+    PACING_IDLE      // like vsync while something animates, block on events otherwise
+};
+
+// Frame times of the last WINDOW frames, milliseconds
+class FrameStats
+{
+public:
+    static const unsigned int WINDOW = 240;
+
+    FrameStats() : samples(WINDOW), sorted(WINDOW), count(0), total(0)
+    {
+    }
+
+    void Add(double ms)
+    {
+        samples[total % WINDOW] = ms;
+        ++total;
+        count = std::min(count + 1, (unsigned int)WINDOW);
+    }
+
+    void Reset() { count = 0; total = 0; }
+
+    unsigned int Count() const { return count; }
+
+    double Average() const
+    {
+        double sum = 0.0;
+        for (unsigned int i = 0; i < count; ++i)
+            sum += samples[i];
+        return count ? sum / count : 0.0;
+    }
+
+    double Min() const { return count ? *std::min_element(samples.begin(), samples.begin() + count) : 0.0; }
+    double Max() const { return count ? *std::max_element(samples.begin(), samples.begin() + count) : 0.0; }
+
+    // Frame time that fraction of the frames stay under, e.g. 0.99
+    double Percentile(double fraction) const
+    {
+        if (count == 0)
+            return 0.0;
+        std::copy(samples.begin(), samples.begin() + count, sorted.begin());
+        unsigned int n = std::min(count - 1, (unsigned int)(fraction * count));
+        std::nth_element(sorted.begin(), sorted.begin() + n, sorted.begin() + count);
+        return sorted[n];
+    }
+
+private:
+    std::vector<double> samples;
+    mutable std::vector<double> sorted;
+    unsigned int count;
+    unsigned long long total;
+};
+
+// Decides how a frame ends. BeginFrame() and EndFrame() bracket the main loop; EndFrame()
+// holds the fixed frame rate and tells the caller whether to block for events or just poll
+// them. The swap interval the render thread should use follows the mode. Frame times are the
+// intervals between BeginFrame() calls, frames that ended waiting for input are not counted.
+class FramePacer
+{
+public:
+    // the limiter sleeps until this close to the deadline and spins the rest, the OS sleep
+    // granularity is too coarse to hit a frame deadline on its own
+    static const int SPIN_MICROSECONDS = 2000;
+
+    FramePacer(PacingMode mode, double targetFps) : mode(mode), started(false), idled(false)
+    {
+        SetTargetFps(targetFps);
+    }
+
+    PacingMode Mode() const { return mode; }
+
+    const char* ModeName() const
+    {
+        static const char *NAMES[] = { "uncapped", "vsync", "fixed", "idle" };
+        return NAMES[mode];
+    }
+
+    void SetMode(PacingMode newMode)
+    {
+        mode = newMode;
+        stats.Reset();
+        deadline = clock::now();
+    }
+
+    void SetTargetFps(double fps)
+    {
+        period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / fps));
+        deadline = clock::now();
+    }
+
+    int SwapInterval() const { return (mode == PACING_VSYNC || mode == PACING_IDLE) ? 1 : 0; }
+
+    void BeginFrame()
+    {
+        clock::time_point now = clock::now();
+        if (started && !idled)
+            stats.Add(std::chrono::duration<double, std::milli>(now - frameStart).count());
+        frameStart = now;
+        started = true;
+        idled = false;
+    }
+
+    // Returns true when the caller should wait for events instead of polling them
+    bool EndFrame(bool animating)
+    {
+        if (mode == PACING_FIXED)
+            limit();
+        idled = mode == PACING_IDLE && !animating;
+        return idled;
+    }
+
+    const FrameStats& Stats() const { return stats; }
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    PacingMode mode;
+    clock::duration period;
+    clock::time_point deadline, frameStart;
+    bool started, idled;
+    FrameStats stats;
+
+    // Waits for the next deadline; deadlines advance by whole periods so the rate does not drift
+    void limit()
+    {
+        clock::time_point now = clock::now();
+        deadline += period;
+        if (deadline < now)
+        {
+            // fell behind, start over from now instead of rushing to catch up
+            deadline = now;
+            return;
+        }
+        clock::duration spin = std::chrono::microseconds(SPIN_MICROSECONDS);
+        if (deadline - now > spin)
+            std::this_thread::sleep_for(deadline - now - spin);
+        while (clock::now() < deadline)
+            std::this_thread::yield();
+    }
+};
+
+#endif
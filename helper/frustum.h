@@ -0,0 +1,33 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <glm/glm.hpp>
+
+// The six planes of a view frustum as (a, b, c, d), a point p is inside a plane when
+// a * p.x + b * p.y + c * p.z + d >= 0. The planes are not normalised, which does not matter
+// for inside/outside tests.
+struct Frustum
+{
+    enum { LEFT_PLANE, RIGHT_PLANE, BOTTOM_PLANE, TOP_PLANE, NEAR_PLANE, FAR_PLANE };
+
+    glm::vec4 Planes[6];
+
+    // Gribb/Hartmann: every plane is the last row of projection * view plus or minus another row
+    static Frustum FromMatrix(const glm::mat4 &viewProjection)
+    {
+        const glm::mat4 &m = viewProjection;
+        glm::vec4 row[4];
+        for (int r = 0; r < 4; ++r)
+            row[r] = glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+        Frustum frustum;
+        frustum.Planes[LEFT_PLANE] = row[3] + row[0];
+        frustum.Planes[RIGHT_PLANE] = row[3] - row[0];
+        frustum.Planes[BOTTOM_PLANE] = row[3] + row[1];
+        frustum.Planes[TOP_PLANE] = row[3] - row[1];
+        frustum.Planes[NEAR_PLANE] = row[3] + row[2];
+        frustum.Planes[FAR_PLANE] = row[3] - row[2];
+        return frustum;
+    }
+};
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef FRUSTUM_CULLER_H
+#define FRUSTUM_CULLER_H
+
+#include <glm/glm.hpp>
+
+#include "frustum.h"
+#include "job_system.h"
+#include "scene_store.h"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define FRUSTUM_CULLER_SSE
+#endif
+
+// Culls the scene's boxes against a frustum. The bounds are kept as structure of arrays, centre
+// and half extent per axis, so 8 boxes are tested per iteration with AVX (two groups of 4 with
+// SSE). A box is culled when it lies entirely behind one plane. Large scenes are split into
+// chunks culled by the job system's workers; the visible indices come out compacted and in
+// ascending order. Like the rain occlusion, the bounds follow scene edits through the change log.
+class FrustumCuller
+{
+public:
+    static const unsigned int LANES = 8;
+    static const unsigned int CHUNK = 16384; // boxes per job, a multiple of LANES
+
+    FrustumCuller() : count(0), sceneVersion(0)
+    {
+    }
+
+    unsigned int Size() const { return count; }
+
+    void Rebuild(const SceneStore &scene)
+    {
+        resize(scene.Size());
+        for (unsigned int i = 0; i < scene.Size(); ++i)
+            set(i, scene[i]);
+        sceneVersion = scene.Version();
+    }
+
+    // Catches up with the edits made since the last Rebuild() or Update()
+    void Update(const SceneStore &scene)
+    {
+        if (scene.Version() == sceneVersion)
+            return;
+        pending.clear();
+        if (!scene.ChangesSince(sceneVersion, pending))
+        {
+            Rebuild(scene);
+            return;
+        }
+        if (scene.Size() != count)
+            resize(scene.Size());
+        for (unsigned int c = 0; c < pending.size(); ++c)
+            set(pending[c].Index, scene[pending[c].Index]);
+        sceneVersion = scene.Version();
+    }
+
+    // Replaces visible with the indices of the boxes inside the frustum of viewProjection
+    void Cull(const glm::mat4 &viewProjection, JobSystem &jobs, std::vector<unsigned int> &visible)
+    {
+        Cull(Frustum::FromMatrix(viewProjection), jobs, visible);
+    }
+
+    // Same for planes at hand, e.g. the camera's
+    void Cull(const Frustum &frustum, JobSystem &jobs, std::vector<unsigned int> &visible)
+    {
+        unsigned int padded = (unsigned int)centerX.size();
+        unsigned int chunks = (padded + CHUNK - 1) / CHUNK;
+        if (chunks == 1)
+        {
+            // small scenes skip the second pass and cull straight into the result
+            visible.resize(padded);
+            visible.resize(cullRange(frustum, 0, padded, visible.data()));
+            return;
+        }
+
+        // every chunk compacts into its own slice of scratch, then the slices are gathered
+        scratch.resize(padded);
+        chunkVisible.resize(chunks);
+        chunkOffset.resize(chunks);
+        jobs.ParallelFor(0, chunks, 1, [&](unsigned int begin, unsigned int end) {
+            for (unsigned int c = begin; c < end; ++c)
+            {
+                unsigned int first = c * CHUNK;
+                chunkVisible[c] = cullRange(frustum, first, std::min(padded, first + CHUNK), &scratch[first]);
+            }
+        });
+        unsigned int total = 0;
+        for (unsigned int c = 0; c < chunks; ++c)
+        {
+            chunkOffset[c] = total;
+            total += chunkVisible[c];
+        }
+        visible.resize(total);
+        jobs.ParallelFor(0, chunks, 1, [&](unsigned int begin, unsigned int end) {
+            for (unsigned int c = begin; c < end; ++c)
+                std::copy(scratch.begin() + c * CHUNK, scratch.begin() + c * CHUNK + chunkVisible[c], visible.begin() + chunkOffset[c]);
+        });
+    }
+
+private:
+    // structure of arrays, padded to a multiple of LANES with boxes no frustum contains
+    std::vector<float> centerX, centerY, centerZ, extentX, extentY, extentZ;
+    unsigned int count;
+    std::vector<unsigned int> scratch, chunkVisible, chunkOffset;
+    std::vector<SceneChange> pending;
+    unsigned long sceneVersion;
+
+    void resize(unsigned int n)
+    {
+        unsigned int padded = (n + LANES - 1) / LANES * LANES;
+        std::vector<float> *arrays[] = { &centerX, &centerY, &centerZ, &extentX, &extentY, &extentZ };
+        for (int a = 0; a < 6; ++a)
+            arrays[a]->resize(padded, 0.0f);
+        // a negative extent puts the padding behind every plane
+        for (unsigned int i = n; i < padded; ++i)
+        {
+            centerX[i] = centerY[i] = centerZ[i] = 0.0f;
+            extentX[i] = extentY[i] = extentZ[i] = -1.0e30f;
+        }
+        count = n;
+    }
+
+    void set(unsigned int i, const SceneBox &box)
+    {
+        glm::vec3 extent = box.Scale * CUBE_HALF_EXTENT;
+        centerX[i] = box.Position.x;
+        centerY[i] = box.Position.y;
+        centerZ[i] = box.Position.z;
+        extentX[i] = std::abs(extent.x);
+        extentY[i] = std::abs(extent.y);
+        extentZ[i] = std::abs(extent.z);
+    }
+
+    // Writes the visible indices of [begin, end) to out, returns how many there are. end - begin
+    // is a multiple of LANES and out has room for all of them.
+    unsigned int cullRange(const Frustum &frustum, unsigned int begin, unsigned int end, unsigned int *out) const
+    {
+        // per plane: normal, distance and absolute normal, the distance of a box's farthest
+        // corner along the normal is dot(n, centre) + d + dot(|n|, extent)
+        float plane[6][7];
+        for (int p = 0; p < 6; ++p)
+        {
+            const glm::vec4 &f = frustum.Planes[p];
+            float values[7] = { f.x, f.y, f.z, f.w, std::abs(f.x), std::abs(f.y), std::abs(f.z) };
+            std::copy(values, values + 7, plane[p]);
+        }
+
+        unsigned int n = 0;
+#if defined(__AVX__)
+        __m256 zero = _mm256_setzero_ps();
+        for (unsigned int i = begin; i < end; i += 8)
+        {
+            __m256 cx = _mm256_loadu_ps(&centerX[i]), cy = _mm256_loadu_ps(&centerY[i]), cz = _mm256_loadu_ps(&centerZ[i]);
+            __m256 ex = _mm256_loadu_ps(&extentX[i]), ey = _mm256_loadu_ps(&extentY[i]), ez = _mm256_loadu_ps(&extentZ[i]);
+            int mask = 0xFF;
+            for (int p = 0; p < 6 && mask; ++p)
+            {
+                __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane[p][0]), cx), _mm256_mul_ps(_mm256_set1_ps(plane[p][1]), cy)),
+                                         _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane[p][2]), cz), _mm256_set1_ps(plane[p][3])));
+                __m256 r = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane[p][4]), ex), _mm256_mul_ps(_mm256_set1_ps(plane[p][5]), ey)),
+                                         _mm256_mul_ps(_mm256_set1_ps(plane[p][6]), ez));
+                mask &= _mm256_movemask_ps(_mm256_cmp_ps(_mm256_add_ps(d, r), zero, _CMP_GE_OQ));
+            }
+            n = emit(mask, 8, i - begin, begin, out, n);
+        }
+#elif defined(FRUSTUM_CULLER_SSE)
+        __m128 zero = _mm_setzero_ps();
+        for (unsigned int i = begin; i < end; i += 4)
+        {
+            __m128 cx = _mm_loadu_ps(&centerX[i]), cy = _mm_loadu_ps(&centerY[i]), cz = _mm_loadu_ps(&centerZ[i]);
+            __m128 ex = _mm_loadu_ps(&extentX[i]), ey = _mm_loadu_ps(&extentY[i]), ez = _mm_loadu_ps(&extentZ[i]);
+            int mask = 0xF;
+            for (int p = 0; p < 6 && mask; ++p)
+            {
+                __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane[p][0]), cx), _mm_mul_ps(_mm_set1_ps(plane[p][1]), cy)),
+                                      _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane[p][2]), cz), _mm_set1_ps(plane[p][3])));
+                __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane[p][4]), ex), _mm_mul_ps(_mm_set1_ps(plane[p][5]), ey)),
+                                      _mm_mul_ps(_mm_set1_ps(plane[p][6]), ez));
+                mask &= _mm_movemask_ps(_mm_cmpge_ps(_mm_add_ps(d, r), zero));
+            }
+            n = emit(mask, 4, i - begin, begin, out, n);
+        }
+#else
+        for (unsigned int i = begin; i < end; ++i)
+        {
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; ++p)
+                inside = plane[p][0] * centerX[i] + plane[p][1] * centerY[i] + plane[p][2] * centerZ[i] + plane[p][3] +
+                         plane[p][4] * extentX[i] + plane[p][5] * extentY[i] + plane[p][6] * extentZ[i] >= 0.0f;
+            if (inside)
+                out[n++] = i;
+        }
+#endif
+        return n;
+    }
+
+    // Appends the indices of the set bits of mask; lane k is box begin + offset + k. The stores
+    // are unconditional, only the count depends on the mask, so there is no branch per box;
+    // n never passes offset + k, so they stay inside the range's part of out.
+    static unsigned int emit(int mask, unsigned int lanes, unsigned int offset, unsigned int begin, unsigned int *out, unsigned int n)
+    {
+        if (mask == 0)
+            return n;
+        for (unsigned int k = 0; k < lanes; ++k)
+        {
+            out[n] = begin + offset + k;
+            n += (mask >> k) & 1;
+        }
+        return n;
+    }
+};
+
+#endif
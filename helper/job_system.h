@@ -0,0 +1,388 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <new>
+#include <cassert>
+#include <algorithm>
+
+// A unit of work for the JobSystem. The callable is stored inline, so creating a job never
+// touches the heap; jobs come from fixed per-thread rings and are recycled round robin,
+// skipping those still in flight.
+struct Job
+{
+    static const unsigned int STORAGE = 64;
+    static const unsigned int MAX_DEPENDENTS = 8;
+
+    void (*invoke)(Job *job);
+    Job *parent;
+    // this job plus its unfinished children; the job starts finishing when it reaches 0
+    std::atomic<int> unfinished;
+    // unresolved dependencies plus one for the pending Run(); the job is queued at 0
+    std::atomic<int> blockers;
+    std::atomic_flag lock;
+    // set once finishing has handed off the dependents and the parent, the slot is only
+    // reused, and waiters only return, after that
+    std::atomic<bool> released;
+    bool done;
+    unsigned int dependentCount;
+    Job *dependents[MAX_DEPENDENTS];
+    alignas(16) unsigned char storage[STORAGE];
+
+    Job() : invoke(NULL), parent(NULL), unfinished(0), blockers(0), released(true), done(true), dependentCount(0)
+    {
+        lock.clear();
+    }
+};
+
+// Work-stealing task scheduler. Every worker thread owns a deque: it pushes and pops its own
+// work at the back, idle workers steal the oldest work from the front of someone else's.
+// The thread that constructs the system is worker 0 and runs jobs whenever it Wait()s, so
+// no core sits idle while it blocks. Jobs can have children (a parent only finishes once all
+// of its children have) and dependencies (a job is held back until they finish). Work that
+// must run on the thread owning the GL context goes through RunOnGLThread() and is executed
+// when that thread calls DrainGLThread().
+class JobSystem
+{
+public:
+    static const unsigned int JOBS_PER_THREAD = 4096;
+    static const unsigned int MAX_THREADS = 32;
+    static const unsigned int RANGES_PER_WORKER = 8; // most ranges ParallelFor splits into, per worker
+
+    // workers counts the calling thread; 0 picks one per hardware thread
+    explicit JobSystem(unsigned int workers = 0) : running(true), sleeping(0), nextThread(0)
+    {
+        if (workers == 0)
+            workers = std::max(1u, std::thread::hardware_concurrency());
+        workerCount = std::min(workers, (unsigned int)MAX_THREADS);
+        queues = new Queue[workerCount];
+        for (unsigned int i = 0; i < MAX_THREADS; ++i)
+            rings[i] = NULL;
+        threadIndex() = 0;
+        for (unsigned int i = 1; i < workerCount; ++i)
+            threads.push_back(std::thread(&JobSystem::workerLoop, this, i));
+    }
+
+    ~JobSystem()
+    {
+        {
+            std::lock_guard<std::mutex> guard(sleepMutex);
+            running = false;
+        }
+        wake.notify_all();
+        for (unsigned int i = 0; i < threads.size(); ++i)
+            threads[i].join();
+        delete[] queues;
+        for (unsigned int i = 0; i < MAX_THREADS; ++i)
+            delete rings[i];
+    }
+
+    unsigned int WorkerCount() const { return workerCount; }
+
+    // Slot of the calling thread, below MAX_THREADS; workers come first, other threads are
+    // numbered on first use. Lets callers keep per-thread data without locking.
+    unsigned int ThreadIndex() { return currentThread(); }
+
+    // Creates a job that calls f() once run. Nothing executes until Run() is called.
+    template <typename F>
+    Job* Create(F f)
+    {
+        return CreateChild(NULL, f);
+    }
+
+    // Like Create(), but parent is not finished until this job is
+    template <typename F>
+    Job* CreateChild(Job *parent, F f)
+    {
+        static_assert(sizeof(F) <= Job::STORAGE, "job callable too large, capture by reference");
+        Job *job = allocate();
+        new (job->storage) F(f);
+        job->invoke = &invokeCallable<F>;
+        job->parent = parent;
+        job->unfinished.store(1, std::memory_order_relaxed);
+        job->blockers.store(1, std::memory_order_relaxed);
+        job->lock.clear();
+        job->released.store(false, std::memory_order_relaxed);
+        job->done = false;
+        job->dependentCount = 0;
+        if (parent)
+            parent->unfinished.fetch_add(1, std::memory_order_relaxed);
+        return job;
+    }
+
+    // Holds job back until dependency has finished. Must be called before Run(job).
+    void AddDependency(Job *job, Job *dependency)
+    {
+        while (dependency->lock.test_and_set(std::memory_order_acquire))
+            std::this_thread::yield();
+        if (!dependency->done)
+        {
+            assert(dependency->dependentCount < Job::MAX_DEPENDENTS);
+            job->blockers.fetch_add(1, std::memory_order_relaxed);
+            dependency->dependents[dependency->dependentCount++] = job;
+        }
+        dependency->lock.clear(std::memory_order_release);
+    }
+
+    // Submits a job; it is queued as soon as its dependencies are finished
+    void Run(Job *job)
+    {
+        if (job->blockers.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            push(job);
+    }
+
+    // Runs other jobs on this thread until job has finished
+    void Wait(const Job *job)
+    {
+        while (!job->released.load(std::memory_order_acquire))
+        {
+            Job *next = take(currentThread());
+            if (next)
+                execute(next);
+            else
+                std::this_thread::yield();
+        }
+    }
+
+    bool Finished(const Job *job) const
+    {
+        return job->released.load(std::memory_order_acquire);
+    }
+
+    // Splits [begin, end) into ranges of at least grain items, runs body(rangeBegin, rangeEnd)
+    // on every worker and returns once all ranges are done. Big loops get bigger ranges, at most
+    // RANGES_PER_WORKER per worker, so the job count stays far below the rings' size.
+    template <typename Body>
+    void ParallelFor(unsigned int begin, unsigned int end, unsigned int grain, const Body &body)
+    {
+        if (end <= begin)
+            return;
+        unsigned int ranges = workerCount * RANGES_PER_WORKER;
+        grain = std::max(std::max(grain, 1u), (end - begin + ranges - 1) / ranges);
+        if (end - begin <= grain || workerCount == 1)
+        {
+            body(begin, end);
+            return;
+        }
+        Job *root = Create([] {});
+        for (unsigned int rangeBegin = begin; rangeBegin < end; rangeBegin += grain)
+        {
+            unsigned int rangeEnd = std::min(end, rangeBegin + grain);
+            Run(CreateChild(root, [&body, rangeBegin, rangeEnd] { body(rangeBegin, rangeEnd); }));
+        }
+        Run(root);
+        Wait(root);
+    }
+
+    // Queues f() to be executed on the GL thread by the next DrainGLThread()
+    template <typename F>
+    void RunOnGLThread(F f)
+    {
+        Job *job = Create(f);
+        std::lock_guard<std::mutex> guard(glMutex);
+        glQueue.push_back(job);
+    }
+
+    // Executes everything queued with RunOnGLThread(); call once per frame on the thread that
+    // owns the GL context
+    void DrainGLThread()
+    {
+        {
+            std::lock_guard<std::mutex> guard(glMutex);
+            if (glQueue.empty())
+                return;
+            glDraining.swap(glQueue);
+        }
+        for (unsigned int i = 0; i < glDraining.size(); ++i)
+            execute(glDraining[i]);
+        glDraining.clear();
+    }
+
+private:
+    // Bounded deque of one worker; the owner uses the back, thieves the front
+    struct Queue
+    {
+        std::mutex mutex;
+        Job *jobs[JOBS_PER_THREAD];
+        unsigned int front, back;
+        Queue() : front(0), back(0) {}
+    };
+
+    // Job storage of one thread, handed out round robin
+    struct Ring
+    {
+        Job jobs[JOBS_PER_THREAD];
+        unsigned int next;
+        Ring() : next(0) {}
+    };
+
+    unsigned int workerCount;
+    Queue *queues;
+    Ring *rings[MAX_THREADS]; // created by each thread on its first job
+    std::vector<std::thread> threads;
+    bool running;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<int> sleeping;
+    std::atomic<unsigned int> nextThread; // ring slots for threads that are not workers
+    std::mutex glMutex;
+    std::vector<Job*> glQueue, glDraining;
+
+    static int& threadIndex()
+    {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    // Index of the calling thread; threads outside the pool get their own ring on first use
+    unsigned int currentThread()
+    {
+        int &index = threadIndex();
+        if (index < 0)
+        {
+            index = (int)(workerCount + nextThread.fetch_add(1));
+            assert(index < (int)MAX_THREADS);
+        }
+        return (unsigned int)index;
+    }
+
+    template <typename F>
+    static void invokeCallable(Job *job)
+    {
+        F *f = reinterpret_cast<F*>(job->storage);
+        (*f)();
+        f->~F();
+    }
+
+    // Next free job of the calling thread's ring. Jobs still in flight are skipped; when the
+    // whole ring is in flight the thread works off queued jobs until one of them finishes.
+    Job* allocate()
+    {
+        unsigned int index = currentThread();
+        if (rings[index] == NULL)
+            rings[index] = new Ring();
+        Ring &ring = *rings[index];
+        while (true)
+        {
+            for (unsigned int tries = 0; tries < JOBS_PER_THREAD; ++tries)
+            {
+                Job *job = &ring.jobs[ring.next++ % JOBS_PER_THREAD];
+                if (job->released.load(std::memory_order_acquire))
+                    return job;
+            }
+            Job *next = take(index);
+            if (next)
+                execute(next);
+            else
+                std::this_thread::yield();
+        }
+    }
+
+    void push(Job *job)
+    {
+        // threads outside the pool hand their work to worker 0's deque
+        unsigned int index = currentThread();
+        Queue &queue = queues[index < workerCount ? index : 0];
+        {
+            std::lock_guard<std::mutex> guard(queue.mutex);
+            if (queue.back - queue.front < JOBS_PER_THREAD)
+            {
+                queue.jobs[queue.back++ % JOBS_PER_THREAD] = job;
+                job = NULL;
+            }
+        }
+        // the deque is full: no room to share the job, so this thread runs it right away
+        if (job)
+        {
+            execute(job);
+            return;
+        }
+        if (sleeping.load(std::memory_order_acquire) > 0)
+        {
+            std::lock_guard<std::mutex> guard(sleepMutex);
+            wake.notify_one();
+        }
+    }
+
+    // Pops the newest job of the own deque, else steals the oldest job of another worker
+    Job* take(unsigned int index)
+    {
+        if (index < workerCount)
+        {
+            Queue &own = queues[index];
+            std::lock_guard<std::mutex> guard(own.mutex);
+            if (own.back != own.front)
+                return own.jobs[--own.back % JOBS_PER_THREAD];
+        }
+        for (unsigned int offset = 1; offset <= workerCount; ++offset)
+        {
+            Queue &victim = queues[(index + offset) % workerCount];
+            std::lock_guard<std::mutex> guard(victim.mutex);
+            if (victim.back != victim.front)
+                return victim.jobs[victim.front++ % JOBS_PER_THREAD];
+        }
+        return NULL;
+    }
+
+    void execute(Job *job)
+    {
+        job->invoke(job);
+        finish(job);
+    }
+
+    void finish(Job *job)
+    {
+        if (job->unfinished.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+
+        while (job->lock.test_and_set(std::memory_order_acquire))
+            std::this_thread::yield();
+        job->done = true;
+        unsigned int count = job->dependentCount;
+        Job *dependents[Job::MAX_DEPENDENTS];
+        std::copy(job->dependents, job->dependents + count, dependents);
+        Job *parent = job->parent;
+        job->lock.clear(std::memory_order_release);
+
+        for (unsigned int i = 0; i < count; ++i)
+            Run(dependents[i]);
+        if (parent)
+            finish(parent);
+        // nothing of job is touched past this point, its slot may be handed out again
+        job->released.store(true, std::memory_order_release);
+    }
+
+    void workerLoop(unsigned int index)
+    {
+        threadIndex() = (int)index;
+        unsigned int idle = 0;
+        while (true)
+        {
+            Job *job = take(index);
+            if (job)
+            {
+                execute(job);
+                idle = 0;
+                continue;
+            }
+            if (++idle < 64)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            // nothing to do for a while: sleep until a push, with a timeout as a safety net
+            std::unique_lock<std::mutex> guard(sleepMutex);
+            if (!running)
+                return;
+            sleeping.fetch_add(1, std::memory_order_acq_rel);
+            wake.wait_for(guard, std::chrono::milliseconds(1));
+            sleeping.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+};
+
+#endif
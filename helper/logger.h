@@ -0,0 +1,233 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+// messages below this level are compiled out, arguments are not even evaluated
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_AT(level, ...) do { if ((level) >= LOG_LEVEL) Logger::Instance().Write((level), __VA_ARGS__); } while (0)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Asynchronous logger. Write() only stores the format pointer, a timestamp and the raw
+// arguments as a fixed-size record in the calling thread's ring buffer; a background thread
+// formats the records and writes them out in batches. Writers never lock, allocate or wait:
+// when a ring is full the message is dropped and counted instead. Each "{}" in the format is
+// replaced by the next argument. Formats and string arguments are kept by pointer, so they
+// must be string literals or otherwise outlive the program.
+class Logger
+{
+public:
+    static const unsigned int MAX_ARGUMENTS = 8;
+    static const unsigned int RECORDS_PER_THREAD = 4096;
+    static const unsigned int MAX_THREADS = 64;
+
+    static Logger& Instance()
+    {
+        static Logger logger;
+        return logger;
+    }
+
+    ~Logger()
+    {
+        running = false;
+        writer.join();
+        flush();
+        for (unsigned int i = 0; i < MAX_THREADS; ++i)
+            delete rings[i].load();
+    }
+
+    template <typename... Args>
+    void Write(int level, const char *format, Args... args)
+    {
+        static_assert(sizeof...(Args) <= MAX_ARGUMENTS, "too many log arguments");
+        Ring *ring = localRing();
+        if (ring == NULL)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        unsigned int head = ring->head.load(std::memory_order_relaxed);
+        if (head - ring->tail.load(std::memory_order_acquire) == RECORDS_PER_THREAD)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        Record &record = ring->records[head % RECORDS_PER_THREAD];
+        record.format = format;
+        record.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        record.level = (unsigned char)level;
+        record.count = 0;
+        int unpack[] = { 0, (encode(record.arguments[record.count++], args), 0)... };
+        (void)unpack;
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+
+    // Messages lost because a ring was full
+    unsigned long long Dropped() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    struct Argument
+    {
+        enum Type { SIGNED, UNSIGNED, REAL, STRING } type;
+        union
+        {
+            long long i;
+            unsigned long long u;
+            double d;
+            const char *s;
+        };
+    };
+
+    struct Record
+    {
+        const char *format;
+        double time;
+        unsigned char level, count;
+        Argument arguments[MAX_ARGUMENTS];
+    };
+
+    // Single producer (the owning thread), single consumer (the writer thread)
+    struct Ring
+    {
+        std::atomic<unsigned int> head, tail;
+        Record records[RECORDS_PER_THREAD];
+        Ring() : head(0), tail(0) {}
+    };
+
+    std::atomic<Ring*> rings[MAX_THREADS];
+    std::atomic<unsigned int> ringCount;
+    std::atomic<unsigned long long> dropped;
+    unsigned long long reported;
+    std::atomic<bool> running;
+    std::chrono::steady_clock::time_point start;
+    std::string line;
+    std::thread writer;
+
+    Logger() : ringCount(0), dropped(0), reported(0), running(true), start(std::chrono::steady_clock::now())
+    {
+        for (unsigned int i = 0; i < MAX_THREADS; ++i)
+            rings[i].store(NULL);
+        writer = std::thread(&Logger::writerLoop, this);
+    }
+
+    static void encode(Argument &argument, int value) { argument.type = Argument::SIGNED; argument.i = value; }
+    static void encode(Argument &argument, long value) { argument.type = Argument::SIGNED; argument.i = value; }
+    static void encode(Argument &argument, long long value) { argument.type = Argument::SIGNED; argument.i = value; }
+    static void encode(Argument &argument, unsigned int value) { argument.type = Argument::UNSIGNED; argument.u = value; }
+    static void encode(Argument &argument, unsigned long value) { argument.type = Argument::UNSIGNED; argument.u = value; }
+    static void encode(Argument &argument, unsigned long long value) { argument.type = Argument::UNSIGNED; argument.u = value; }
+    static void encode(Argument &argument, double value) { argument.type = Argument::REAL; argument.d = value; }
+    static void encode(Argument &argument, const char *value) { argument.type = Argument::STRING; argument.s = value; }
+
+    // The calling thread's ring, registered on its first message; NULL once every slot is taken
+    Ring* localRing()
+    {
+        static thread_local Ring *ring = NULL;
+        if (ring == NULL)
+        {
+            unsigned int index = ringCount.fetch_add(1);
+            if (index >= MAX_THREADS)
+                return NULL;
+            ring = new Ring();
+            rings[index].store(ring, std::memory_order_release);
+        }
+        return ring;
+    }
+
+    void writerLoop()
+    {
+        while (running.load())
+        {
+            if (!flush())
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+
+    // Formats and writes everything queued so far; returns whether there was anything
+    bool flush()
+    {
+        static const char *LEVEL_NAMES[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+        bool written = false;
+        unsigned int count = std::min(ringCount.load(std::memory_order_acquire), (unsigned int)MAX_THREADS);
+        for (unsigned int r = 0; r < count; ++r)
+        {
+            // the slot is claimed before the ring is stored, it may not be there yet
+            Ring *ring = rings[r].load(std::memory_order_acquire);
+            if (ring == NULL)
+                continue;
+            unsigned int tail = ring->tail.load(std::memory_order_relaxed);
+            unsigned int head = ring->head.load(std::memory_order_acquire);
+            for (; tail != head; ++tail)
+            {
+                const Record &record = ring->records[tail % RECORDS_PER_THREAD];
+                char prefix[48];
+                snprintf(prefix, sizeof(prefix), "[%10.4f %-5s] ", record.time, LEVEL_NAMES[record.level < 4 ? record.level : 3]);
+                line = prefix;
+                format(record);
+                line += '\n';
+                fwrite(line.data(), 1, line.size(), stdout);
+                written = true;
+            }
+            ring->tail.store(tail, std::memory_order_release);
+        }
+
+        unsigned long long lost = dropped.load(std::memory_order_relaxed);
+        if (lost != reported)
+        {
+            fprintf(stdout, "[logger] %llu messages dropped\n", lost - reported);
+            reported = lost;
+            written = true;
+        }
+        if (written)
+            fflush(stdout);
+        return written;
+    }
+
+    void format(const Record &record)
+    {
+        unsigned int next = 0;
+        char number[32];
+        for (const char *c = record.format; *c; ++c)
+        {
+            if (c[0] != '{' || c[1] != '}' || next >= record.count)
+            {
+                line += *c;
+                continue;
+            }
+            const Argument &argument = record.arguments[next++];
+            if (argument.type == Argument::STRING)
+                line += argument.s ? argument.s : "(null)";
+            else
+            {
+                if (argument.type == Argument::SIGNED)
+                    snprintf(number, sizeof(number), "%lld", argument.i);
+                else if (argument.type == Argument::UNSIGNED)
+                    snprintf(number, sizeof(number), "%llu", argument.u);
+                else
+                    snprintf(number, sizeof(number), "%g", argument.d);
+                line += number;
+            }
+            ++c;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef OCCLUSION_HEIGHTMAP_H
+#define OCCLUSION_HEIGHTMAP_H
+
+#include <glm/glm.hpp>
+
+#include "scene_store.h"
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// Top-down height field over the x/z plane: each cell holds the highest box top whose
+// footprint covers the cell centre, or the floor when nothing does. Falling particles
+// compare their y against Height(x, z) to find out whether they hit something.
+class OcclusionHeightmap
+{
+public:
+    OcclusionHeightmap(float minX, float minZ, float maxX, float maxZ, float cellSize, float floor)
+        : minX(minX), minZ(minZ), cellSize(cellSize), floor(floor), sceneVersion(0)
+    {
+        columns = (int)std::ceil((maxX - minX) / cellSize);
+        rows = (int)std::ceil((maxZ - minZ) / cellSize);
+        heights.assign(columns * rows, floor);
+    }
+
+    // O(1) lookup; positions outside the grid only see the floor
+    float Height(float x, float z) const
+    {
+        int column = (int)std::floor((x - minX) / cellSize);
+        int row = (int)std::floor((z - minZ) / cellSize);
+        if (column < 0 || row < 0 || column >= columns || row >= rows)
+            return floor;
+        return heights[row * columns + column];
+    }
+
+    void Rebuild(const SceneStore &scene)
+    {
+        heights.assign(columns * rows, floor);
+        for (unsigned int i = 0; i < scene.Size(); ++i)
+            raise(scene[i], 0, 0, columns - 1, rows - 1);
+        sceneVersion = scene.Version();
+    }
+
+    // Catches up with the scene's change log, re-rasterising only the cells under the old and
+    // new footprint of each changed box. Falls back to Rebuild() when the log is too short.
+    void Update(const SceneStore &scene)
+    {
+        if (scene.Version() == sceneVersion)
+            return;
+        pending.clear();
+        if (!scene.ChangesSince(sceneVersion, pending))
+        {
+            Rebuild(scene);
+            return;
+        }
+        for (unsigned int c = 0; c < pending.size(); ++c)
+        {
+            const SceneBox &box = scene[pending[c].Index];
+            refresh(scene, pending[c].OldMin, pending[c].OldMax);
+            refresh(scene, box.Min(), box.Max());
+        }
+        sceneVersion = scene.Version();
+    }
+
+private:
+    float minX, minZ, cellSize, floor;
+    int columns, rows;
+    std::vector<float> heights;
+    std::vector<SceneChange> pending;
+    unsigned long sceneVersion;
+
+    // Cell range whose centres lie inside [lo, hi] on x/z; returns false if it is empty
+    bool cellRange(glm::vec3 lo, glm::vec3 hi, int &c0, int &r0, int &c1, int &r1) const
+    {
+        c0 = std::max(0, (int)std::ceil((lo.x - minX) / cellSize - 0.5f));
+        r0 = std::max(0, (int)std::ceil((lo.z - minZ) / cellSize - 0.5f));
+        c1 = std::min(columns - 1, (int)std::floor((hi.x - minX) / cellSize - 0.5f));
+        r1 = std::min(rows - 1, (int)std::floor((hi.z - minZ) / cellSize - 0.5f));
+        return c0 <= c1 && r0 <= r1;
+    }
+
+    // Lifts the cells in [c0, c1] x [r0, r1] covered by box up to its top
+    void raise(const SceneBox &box, int c0, int r0, int c1, int r1)
+    {
+        int bc0, br0, bc1, br1;
+        if (!cellRange(box.Min(), box.Max(), bc0, br0, bc1, br1))
+            return;
+        bc0 = std::max(bc0, c0); br0 = std::max(br0, r0);
+        bc1 = std::min(bc1, c1); br1 = std::min(br1, r1);
+        float top = box.Max().y;
+        for (int r = br0; r <= br1; ++r)
+            for (int c = bc0; c <= bc1; ++c)
+                heights[r * columns + c] = std::max(heights[r * columns + c], top);
+    }
+
+    // Recomputes the cells under [lo, hi] from every box that overlaps them
+    void refresh(const SceneStore &scene, glm::vec3 lo, glm::vec3 hi)
+    {
+        int c0, r0, c1, r1;
+        if (lo.x > hi.x || !cellRange(lo, hi, c0, r0, c1, r1))
+            return;
+        for (int r = r0; r <= r1; ++r)
+            for (int c = c0; c <= c1; ++c)
+                heights[r * columns + c] = floor;
+        for (unsigned int i = 0; i < scene.Size(); ++i)
+        {
+            glm::vec3 boxMin = scene[i].Min(), boxMax = scene[i].Max();
+            if (boxMax.x < lo.x || boxMin.x > hi.x || boxMax.z < lo.z || boxMin.z > hi.z)
+                continue;
+            raise(scene[i], c0, r0, c1, r1);
+        }
+    }
+};
+
+#endif
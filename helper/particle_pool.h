@@ -0,0 +1,87 @@
+#ifndef PARTICLE_POOL_H
+#define PARTICLE_POOL_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+// Fixed-capacity particle storage shared by any number of emitters. Live particles are
+// always packed into [0, Size()): killing one moves the last live particle into its slot,
+// so update and draw loops only ever walk live particles, never the whole capacity.
+template <typename T>
+class ParticlePool
+{
+public:
+    explicit ParticlePool(unsigned int capacity) : particles(capacity), count(0)
+    {
+    }
+
+    // Returns a slot for a new particle, or NULL when the pool is exhausted
+    T* Spawn()
+    {
+        if (count == particles.size())
+            return NULL;
+        return &particles[count++];
+    }
+
+    // Removes particle i by swapping the last live particle into its place. Callers
+    // iterating the pool must revisit index i afterwards, as it now holds another particle.
+    void Kill(unsigned int i)
+    {
+        particles[i] = particles[--count];
+    }
+
+    void Clear()
+    {
+        count = 0;
+    }
+
+    T& operator[](unsigned int i) { return particles[i]; }
+    const T& operator[](unsigned int i) const { return particles[i]; }
+
+    T* Data() { return particles.data(); }
+    unsigned int Size() const { return count; }
+    unsigned int Capacity() const { return (unsigned int)particles.size(); }
+
+private:
+    std::vector<T> particles;
+    unsigned int count;
+};
+
+// A point source that feeds a shared ParticlePool at a fixed rate (particles per cycle).
+// Fractional rates are carried over between cycles so low-rate sources still emit.
+struct ParticleEmitter
+{
+    glm::vec3 Position;
+    float Rate;
+    float Pending;
+
+    ParticleEmitter(glm::vec3 position, float rate) : Position(position), Rate(rate), Pending(0.0f)
+    {
+    }
+
+    // Spawns this cycle's particles into the pool and hands each one to init(particle, Position).
+    // Returns how many were spawned; emission stops early when the pool is full.
+    template <typename T, typename Init>
+    unsigned int Emit(ParticlePool<T> &pool, Init init)
+    {
+        Pending += Rate;
+        unsigned int spawned = 0;
+        while (Pending >= 1.0f)
+        {
+            T* particle = pool.Spawn();
+            if (particle == NULL)
+            {
+                // the pool is full: drop the backlog instead of bursting once space frees up
+                Pending = 0.0f;
+                break;
+            }
+            init(*particle, Position);
+            Pending -= 1.0f;
+            spawned++;
+        }
+        return spawned;
+    }
+};
+
+#endif
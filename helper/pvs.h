@@ -0,0 +1,368 @@
+#ifndef PVS_H
+#define PVS_H
+
+#include <glm/glm.hpp>
+
+#include "job_system.h"
+#include "scene_store.h"
+#include "bvh.h"
+
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// Potentially visible sets, baked offline for a grid of cells over the region the camera moves
+// in. A cell's set is every box hit by rays cast from sample points inside it, plus the boxes
+// reaching into the cell. It is stored as a bitset over the box indices, run-length coded when
+// that is smaller: alternating runs of hidden and visible boxes, each length a varint, so the
+// long hidden stretches of a big scene take a byte or two. Ray sampling can miss a box that is
+// only seen through gaps narrower than the ray spacing; more samples trade bake time for fewer
+// misses. A bake only fits the scene it was made from: Load() rejects a file of different boxes,
+// and decodes every cell once so a damaged file is rejected rather than read out of bounds.
+class PotentiallyVisibleSet
+{
+public:
+    static const unsigned int CELLS_PER_BATCH = 32; // cells whose rays are cast together
+
+    PotentiallyVisibleSet() : cellSize(1.0f), fingerprint(0), boxCount(0)
+    {
+        dims[0] = dims[1] = dims[2] = 0;
+    }
+
+    bool Empty() const { return cellStart.empty(); }
+    unsigned int CellCount() const { return dims[0] * dims[1] * dims[2]; }
+    // size of the compressed sets
+    size_t Bytes() const { return runs.size(); }
+
+    // Bakes the cells of size covering [min, max]: from samples random points per cell,
+    // raysPerSample directions each, rays ending at maxDistance; the rays of CELLS_PER_BATCH
+    // cells at a time are cast by the job system's workers
+    void Bake(const SceneStore &scene, const Bvh &bvh, JobSystem &jobs, glm::vec3 min, glm::vec3 max, float size,
+              unsigned int samples, unsigned int raysPerSample, float maxDistance)
+    {
+        origin = min;
+        cellSize = size;
+        for (int a = 0; a < 3; ++a)
+            dims[a] = std::max(1, (int)std::ceil((max[a] - min[a]) / size));
+        boxCount = scene.Size();
+        fingerprint = Fingerprint(scene);
+        runs.clear();
+        cellStart.assign(1, 0);
+
+        // directions spread evenly over the sphere on a Fibonacci spiral
+        std::vector<glm::vec3> directions(raysPerSample);
+        for (unsigned int r = 0; r < raysPerSample; ++r)
+        {
+            float z = 1.0f - (2.0f * r + 1.0f) / raysPerSample;
+            float radius = std::sqrt(std::max(0.0f, 1.0f - z * z));
+            float phi = r * 2.39996323f;
+            directions[r] = glm::vec3(std::cos(phi) * radius, std::sin(phi) * radius, z);
+        }
+
+        unsigned int words = (boxCount + 63) / 64;
+        std::vector<uint64_t> bits(CELLS_PER_BATCH * words);
+        std::vector<Ray> rays;
+        std::vector<RayHit> hits;
+        std::vector<unsigned int> rayCell, inside;
+        unsigned int cells = CellCount();
+        for (unsigned int first = 0; first < cells; first += CELLS_PER_BATCH)
+        {
+            unsigned int last = std::min(cells, first + CELLS_PER_BATCH);
+            std::fill(bits.begin(), bits.end(), 0);
+            rays.clear();
+            rayCell.clear();
+            for (unsigned int c = first; c < last; ++c)
+            {
+                uint64_t *cellBits = &bits[(c - first) * words];
+                glm::vec3 cellMin = cellOrigin(c);
+                inside.clear();
+                bvh.Overlap(cellMin, cellMin + glm::vec3(size), inside);
+                for (unsigned int i = 0; i < inside.size(); ++i)
+                    cellBits[inside[i] / 64] |= (uint64_t)1 << (inside[i] % 64);
+
+                unsigned int state = c * 2654435761u + 1u;
+                for (unsigned int s = 0; s < samples; ++s)
+                {
+                    glm::vec3 point = cellMin + size * glm::vec3(random(state), random(state), random(state));
+                    // a point inside a box sees nothing but that box
+                    inside.clear();
+                    bvh.Overlap(point, point, inside);
+                    if (!inside.empty())
+                        continue;
+                    // every sample turns the spiral by its own angle, so the samples do not
+                    // all look along the same directions
+                    float turn = random(state) * 6.28318531f;
+                    float cosTurn = std::cos(turn), sinTurn = std::sin(turn);
+                    for (unsigned int r = 0; r < raysPerSample; ++r)
+                    {
+                        const glm::vec3 &d = directions[r];
+                        Ray ray;
+                        ray.Origin = point;
+                        ray.Direction = glm::vec3(d.x * cosTurn - d.y * sinTurn, d.x * sinTurn + d.y * cosTurn, d.z);
+                        ray.MaxDistance = maxDistance;
+                        rays.push_back(ray);
+                        rayCell.push_back(c - first);
+                    }
+                }
+            }
+
+            bvh.Intersect(rays, hits, jobs);
+            for (unsigned int r = 0; r < hits.size(); ++r)
+            {
+                if (hits[r].Box < 0)
+                    continue;
+                unsigned int box = (unsigned int)hits[r].Box;
+                bits[rayCell[r] * words + box / 64] |= (uint64_t)1 << (box % 64);
+            }
+            for (unsigned int c = first; c < last; ++c)
+                encode(&bits[(c - first) * words]);
+        }
+    }
+
+    // Cell containing position, -1 outside the grid
+    int Cell(glm::vec3 position) const
+    {
+        if (Empty())
+            return -1;
+        int index[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            float cell = std::floor((position[a] - origin[a]) / cellSize);
+            if (cell < 0.0f || cell >= (float)dims[a])
+                return -1;
+            index[a] = (int)cell;
+        }
+        return (index[2] * dims[1] + index[1]) * dims[0] + index[0];
+    }
+
+    // Replaces visible with the boxes of cell, in ascending order
+    void Visible(int cell, std::vector<unsigned int> &visible) const
+    {
+        visible.clear();
+        size_t at = cellStart[cell];
+        if (runs[at++] == RAW)
+        {
+            for (unsigned int i = 0; i < boxCount; ++i)
+                if ((runs[at + i / 8] >> (i % 8)) & 1)
+                    visible.push_back(i);
+            return;
+        }
+        unsigned int box = 0, run = 0;
+        bool on = false;
+        // Load() checked the runs, the bounds only keep a cell from ever reaching past its own
+        while (readVarint(at, cellStart[cell + 1], run))
+        {
+            run = std::min(run, boxCount - box);
+            if (on)
+            {
+                for (unsigned int k = 0; k < run; ++k)
+                    visible.push_back(box + k);
+            }
+            box += run;
+            on = !on;
+        }
+    }
+
+    bool Save(const char *path) const
+    {
+        std::ofstream file(path, std::ios::binary);
+        if (!file)
+            return false;
+        uint32_t header[] = { MAGIC, boxCount, (uint32_t)dims[0], (uint32_t)dims[1], (uint32_t)dims[2], (uint32_t)runs.size() };
+        float grid[] = { origin.x, origin.y, origin.z, cellSize };
+        file.write((const char*)header, sizeof(header));
+        file.write((const char*)&fingerprint, sizeof(fingerprint));
+        file.write((const char*)grid, sizeof(grid));
+        file.write((const char*)cellStart.data(), cellStart.size() * sizeof(uint32_t));
+        file.write((const char*)runs.data(), runs.size());
+        return (bool)file;
+    }
+
+    // Reads a bake; returns false, and stays empty, when there is none or it was made from
+    // other boxes than scene's
+    bool Load(const char *path, const SceneStore &scene)
+    {
+        *this = PotentiallyVisibleSet();
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+            return false;
+        std::streamoff remaining = file.tellg();
+        file.seekg(0);
+        uint32_t header[6];
+        uint64_t savedFingerprint = 0;
+        float grid[4];
+        if (!file.read((char*)header, sizeof(header)) || !file.read((char*)&savedFingerprint, sizeof(savedFingerprint)) ||
+            !file.read((char*)grid, sizeof(grid)))
+            return false;
+        if (header[0] != MAGIC || header[1] != scene.Size() || savedFingerprint != Fingerprint(scene))
+            return false;
+        if (!std::isfinite(grid[0]) || !std::isfinite(grid[1]) || !std::isfinite(grid[2]) || !(grid[3] > 0.0f) || !std::isfinite(grid[3]))
+            return false;
+        // every cell takes at least a byte, so the sizes must fit in what is left of the file
+        // before anything is allocated for them
+        remaining -= sizeof(header) + sizeof(savedFingerprint) + sizeof(grid);
+        uint64_t cells = 1;
+        for (int a = 0; a < 3; ++a)
+        {
+            if (header[2 + a] == 0 || header[2 + a] > (uint32_t)remaining)
+                return false;
+            cells *= header[2 + a];
+        }
+        if (cells > (uint64_t)remaining || (cells + 1) * sizeof(uint32_t) + header[5] != (uint64_t)remaining)
+            return false;
+        std::vector<uint32_t> starts((size_t)cells + 1);
+        std::vector<unsigned char> bytes(header[5]);
+        if (!file.read((char*)starts.data(), starts.size() * sizeof(uint32_t)) || !file.read((char*)bytes.data(), bytes.size()))
+            return false;
+        if (starts.front() != 0 || starts.back() != bytes.size() || !std::is_sorted(starts.begin(), starts.end()))
+            return false;
+
+        boxCount = header[1];
+        for (int a = 0; a < 3; ++a)
+            dims[a] = (int)header[2 + a];
+        fingerprint = savedFingerprint;
+        origin = glm::vec3(grid[0], grid[1], grid[2]);
+        cellSize = grid[3];
+        cellStart.swap(starts);
+        runs.swap(bytes);
+        for (unsigned int c = 0; c < CellCount(); ++c)
+        {
+            if (!validCell(c))
+            {
+                *this = PotentiallyVisibleSet();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // FNV-1a over the bounds of every box, tells apart the scenes a bake can belong to
+    static uint64_t Fingerprint(const SceneStore &scene)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned int i = 0; i < scene.Size(); ++i)
+        {
+            float bounds[6] = { scene[i].Min().x, scene[i].Min().y, scene[i].Min().z, scene[i].Max().x, scene[i].Max().y, scene[i].Max().z };
+            const unsigned char *bytes = (const unsigned char*)bounds;
+            for (unsigned int b = 0; b < sizeof(bounds); ++b)
+                hash = (hash ^ bytes[b]) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+private:
+    static const uint32_t MAGIC = 0x32535650; // "PVS2"
+    // first byte of a cell's data
+    enum { RAW, RUN_LENGTH };
+
+    glm::vec3 origin;
+    float cellSize;
+    int dims[3];
+    uint64_t fingerprint;
+    unsigned int boxCount;
+    std::vector<uint32_t> cellStart; // offset of every cell's runs, plus the end
+    std::vector<unsigned char> runs; // per cell the encoding, then the plain bits or the runs
+
+    glm::vec3 cellOrigin(unsigned int cell) const
+    {
+        unsigned int x = cell % dims[0], y = cell / dims[0] % dims[1], z = cell / (dims[0] * dims[1]);
+        return origin + cellSize * glm::vec3((float)x, (float)y, (float)z);
+    }
+
+    // xorshift, uniform in [0, 1)
+    static float random(unsigned int &state)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (state >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // Appends one cell's bitset, run-length coded starting with a (possibly empty) hidden run,
+    // or as it is when the runs would take more bytes
+    void encode(const uint64_t *bits)
+    {
+        size_t start = runs.size();
+        unsigned int rawBytes = (boxCount + 7) / 8;
+        runs.push_back((unsigned char)RUN_LENGTH);
+        bool on = false;
+        unsigned int run = 0;
+        for (unsigned int i = 0; i < boxCount; ++i)
+        {
+            bool bit = (bits[i / 64] >> (i % 64)) & 1;
+            if (bit != on)
+            {
+                writeVarint(run);
+                run = 0;
+                on = bit;
+            }
+            ++run;
+        }
+        writeVarint(run);
+        if (runs.size() - start - 1 > rawBytes)
+        {
+            runs.resize(start);
+            runs.push_back((unsigned char)RAW);
+            for (unsigned int b = 0; b < rawBytes; ++b)
+                runs.push_back((unsigned char)(bits[b / 8] >> (b % 8 * 8)));
+        }
+        cellStart.push_back((uint32_t)runs.size());
+    }
+
+    // 7 bits per byte, the high bit marks that more follow
+    void writeVarint(unsigned int value)
+    {
+        while (value >= 0x80)
+        {
+            runs.push_back((unsigned char)(value | 0x80));
+            value >>= 7;
+        }
+        runs.push_back((unsigned char)value);
+    }
+
+    // Reads the varint at at into value, false when it is not complete before end or does not
+    // fit in 32 bits
+    bool readVarint(size_t &at, size_t end, unsigned int &value) const
+    {
+        value = 0;
+        for (int shift = 0; shift < 32 && at < end; shift += 7)
+        {
+            unsigned char byte = runs[at++];
+            if (shift == 28 && byte > 0x0F)
+                return false;
+            value |= (unsigned int)(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    // Whether cell decodes cleanly: a known encoding, RAW of exactly the bitset's size, runs
+    // that are all complete varints and add up to exactly the box count
+    bool validCell(unsigned int cell) const
+    {
+        size_t at = cellStart[cell], end = cellStart[cell + 1];
+        if (at == end)
+            return false;
+        unsigned char encoding = runs[at++];
+        if (encoding == RAW)
+            return end - at == (boxCount + 7) / 8;
+        if (encoding != RUN_LENGTH)
+            return false;
+        uint64_t boxes = 0;
+        unsigned int run;
+        while (at < end)
+        {
+            if (!readVarint(at, end, run))
+                return false;
+            boxes += run;
+            if (boxes > boxCount)
+                return false;
+        }
+        return boxes == boxCount;
+    }
+};
+
+#endif
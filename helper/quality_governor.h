@@ -0,0 +1,93 @@
+#ifndef QUALITY_GOVERNOR_H
+#define QUALITY_GOVERNOR_H
+
+#include "logger.h"
+
+#include <vector>
+#include <algorithm>
+
+// Keeps the frame within a time budget by trading quality. Knobs are registered in priority
+// order, the first one is given up first; level 0 is full quality and every level above gives
+// up a bit more. When the slower of CPU and GPU time stays over budget one knob is lowered by
+// one level, when it stays well under budget the most recently lowered knob is raised again,
+// so quality comes back in the reverse order it went. After each change the governor waits
+// for the effect to show before deciding again. Every decision is logged with its reason.
+class QualityGovernor
+{
+public:
+    static const unsigned int OVER_FRAMES = 10;    // frames over budget before lowering
+    static const unsigned int UNDER_FRAMES = 120;  // frames under headroom before raising
+    static const unsigned int SETTLE_FRAMES = 30;  // frames ignored after a change
+
+    explicit QualityGovernor(double budgetMs) : budgetMs(budgetMs), headroom(0.7), averageMs(0.0), over(0), under(0), settle(0)
+    {
+    }
+
+    // name must outlive the governor, it is logged by pointer
+    unsigned int AddKnob(const char *name, int levels)
+    {
+        Knob knob;
+        knob.Name = name;
+        knob.Level = 0;
+        knob.MaxLevel = levels - 1;
+        knobs.push_back(knob);
+        return (unsigned int)knobs.size() - 1;
+    }
+
+    int Level(unsigned int knob) const { return knobs[knob].Level; }
+    double AverageMs() const { return averageMs; }
+
+    // Feeds one frame; returns true when a knob changed level
+    bool Update(double cpuMs, double gpuMs)
+    {
+        double frameMs = std::max(cpuMs, gpuMs);
+        averageMs = averageMs > 0.0 ? averageMs + 0.1 * (frameMs - averageMs) : frameMs;
+        if (settle > 0)
+        {
+            --settle;
+            return false;
+        }
+        over = averageMs > budgetMs ? over + 1 : 0;
+        under = averageMs < budgetMs * headroom ? under + 1 : 0;
+
+        if (over >= OVER_FRAMES)
+        {
+            for (unsigned int k = 0; k < knobs.size(); ++k)
+                if (knobs[k].Level < knobs[k].MaxLevel)
+                    return change(k, knobs[k].Level + 1, "over budget", cpuMs, gpuMs);
+            over = 0;
+        }
+        else if (under >= UNDER_FRAMES)
+        {
+            for (unsigned int k = (unsigned int)knobs.size(); k-- > 0; )
+                if (knobs[k].Level > 0)
+                    return change(k, knobs[k].Level - 1, "under budget", cpuMs, gpuMs);
+            under = 0;
+        }
+        return false;
+    }
+
+private:
+    struct Knob
+    {
+        const char *Name;
+        int Level, MaxLevel;
+    };
+
+    std::vector<Knob> knobs;
+    double budgetMs, headroom, averageMs;
+    unsigned int over, under, settle;
+
+    bool change(unsigned int knob, int level, const char *reason, double cpuMs, double gpuMs)
+    {
+        LOG_INFO("quality: {} level {} -> {}, {} (average {} ms, cpu {} ms, gpu {} ms, budget {} ms)",
+                 knobs[knob].Name, knobs[knob].Level, level, reason, averageMs, cpuMs, gpuMs, budgetMs);
+        knobs[knob].Level = level;
+        over = 0;
+        under = 0;
+        settle = SETTLE_FRAMES;
+        return true;
+    }
+};
+
+#endif
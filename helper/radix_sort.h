@@ -0,0 +1,175 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include "job_system.h"
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+// Maps a float to a 32-bit key whose unsigned order matches the float order: positive floats
+// get the sign bit set, negative floats are flipped entirely so larger magnitudes sort first.
+inline uint32_t FloatToSortableKey(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+// Sorts an index list by float key, ascending. The index list is expected to be reused from
+// frame to frame: nearly sorted input is detected and finished with an insertion sort, and
+// only badly shuffled input pays for the full LSD radix sort (four 8-bit passes, skipping
+// any pass whose digit is the same for every key). Scratch memory is kept between calls.
+class RadixSorter
+{
+public:
+    // Inputs at least this large split the radix passes across the job system's workers
+    static const unsigned int PARALLEL_THRESHOLD = 65536;
+    // Inputs with at most n / COHERENT_RATIO descents are treated as nearly sorted
+    static const unsigned int COHERENT_RATIO = 64;
+
+    // Without a job system every pass runs on the calling thread
+    explicit RadixSorter(JobSystem *jobs = NULL) : jobs(jobs)
+    {
+    }
+
+    // Keeps order a permutation of [0, n) after particles were added or swap-removed,
+    // preserving the relative order of the indices that survive.
+    static void KeepPermutation(std::vector<unsigned int> &order, unsigned int n)
+    {
+        unsigned int previous = (unsigned int)order.size();
+        unsigned int kept = 0;
+        for (unsigned int i = 0; i < previous; ++i)
+            if (order[i] < n)
+                order[kept++] = order[i];
+        order.resize(kept);
+        for (unsigned int i = previous; i < n; ++i)
+            order.push_back(i);
+    }
+
+    // Reorders indices so that keys[indices[i]] is ascending
+    void Sort(const float *keys, std::vector<unsigned int> &indices)
+    {
+        unsigned int n = (unsigned int)indices.size();
+        if (n < 2)
+            return;
+
+        keyBuffer.resize(n);
+        unsigned int descents = 0;
+        keyBuffer[0] = FloatToSortableKey(keys[indices[0]]);
+        for (unsigned int i = 1; i < n; ++i)
+        {
+            keyBuffer[i] = FloatToSortableKey(keys[indices[i]]);
+            descents += keyBuffer[i] < keyBuffer[i - 1];
+        }
+
+        if (descents == 0)
+            return;
+        if (descents > n / COHERENT_RATIO || !insertionSort(indices))
+            radixSort(indices);
+    }
+
+private:
+    JobSystem *jobs;
+    std::vector<uint32_t> keyBuffer, keyScratch;
+    std::vector<unsigned int> indexScratch;
+    std::vector<unsigned int> histograms; // 256 buckets per thread chunk
+
+    // Few descents can still hide a few keys that travel far; give up once the element moves
+    // exceed a linear budget and leave the (still consistent) half-sorted input to radixSort()
+    bool insertionSort(std::vector<unsigned int> &indices)
+    {
+        uint64_t budget = (uint64_t)indices.size() * 8;
+        for (unsigned int i = 1; i < indices.size(); ++i)
+        {
+            uint32_t key = keyBuffer[i];
+            unsigned int index = indices[i];
+            unsigned int j = i;
+            while (j > 0 && keyBuffer[j - 1] > key)
+            {
+                keyBuffer[j] = keyBuffer[j - 1];
+                indices[j] = indices[j - 1];
+                --j;
+            }
+            keyBuffer[j] = key;
+            indices[j] = index;
+            if (i - j >= budget)
+                return false;
+            budget -= i - j;
+        }
+        return true;
+    }
+
+    void radixSort(std::vector<unsigned int> &indices)
+    {
+        unsigned int n = (unsigned int)indices.size();
+        unsigned int chunks = (jobs != NULL && n >= PARALLEL_THRESHOLD) ? jobs->WorkerCount() : 1;
+        keyScratch.resize(n);
+        indexScratch.resize(n);
+        histograms.resize(256 * chunks);
+
+        uint32_t *keysIn = keyBuffer.data(), *keysOut = keyScratch.data();
+        unsigned int *indicesIn = indices.data(), *indicesOut = indexScratch.data();
+
+        for (unsigned int shift = 0; shift < 32; shift += 8)
+        {
+            // the digit is constant over the whole input: this pass would not move anything
+            uint32_t digit = (keysIn[0] >> shift) & 0xFF;
+            bool trivial = true;
+            for (unsigned int i = 1; i < n && trivial; ++i)
+                trivial = ((keysIn[i] >> shift) & 0xFF) == digit;
+            if (trivial)
+                continue;
+
+            forEachChunk(chunks, n, [&](unsigned int chunk, unsigned int begin, unsigned int end) {
+                unsigned int *histogram = &histograms[chunk * 256];
+                std::memset(histogram, 0, 256 * sizeof(unsigned int));
+                for (unsigned int i = begin; i < end; ++i)
+                    histogram[(keysIn[i] >> shift) & 0xFF]++;
+            });
+
+            // exclusive prefix sum, bucket-major then chunk so the scatter stays stable
+            unsigned int offset = 0;
+            for (unsigned int bucket = 0; bucket < 256; ++bucket)
+                for (unsigned int chunk = 0; chunk < chunks; ++chunk)
+                {
+                    unsigned int count = histograms[chunk * 256 + bucket];
+                    histograms[chunk * 256 + bucket] = offset;
+                    offset += count;
+                }
+
+            forEachChunk(chunks, n, [&](unsigned int chunk, unsigned int begin, unsigned int end) {
+                unsigned int *histogram = &histograms[chunk * 256];
+                for (unsigned int i = begin; i < end; ++i)
+                {
+                    unsigned int destination = histogram[(keysIn[i] >> shift) & 0xFF]++;
+                    keysOut[destination] = keysIn[i];
+                    indicesOut[destination] = indicesIn[i];
+                }
+            });
+
+            std::swap(keysIn, keysOut);
+            std::swap(indicesIn, indicesOut);
+        }
+
+        if (indicesIn != indices.data())
+            std::memcpy(indices.data(), indicesIn, n * sizeof(unsigned int));
+    }
+
+    // Runs body(chunk, begin, end) over equal slices of [0, n), one job per slice
+    template <typename Body>
+    void forEachChunk(unsigned int chunks, unsigned int n, Body body)
+    {
+        if (chunks == 1)
+        {
+            body(0, 0, n);
+            return;
+        }
+        jobs->ParallelFor(0, chunks, 1, [&](unsigned int first, unsigned int last) {
+            for (unsigned int chunk = first; chunk < last; ++chunk)
+                body(chunk, (unsigned int)((uint64_t)n * chunk / chunks), (unsigned int)((uint64_t)n * (chunk + 1) / chunks));
+        });
+    }
+};
+
+#endif
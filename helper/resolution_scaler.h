@@ -0,0 +1,60 @@
+#ifndef RESOLUTION_SCALER_H
+#define RESOLUTION_SCALER_H
+
+#include <cmath>
+#include <algorithm>
+
+// Picks the render resolution scale from measured GPU frame times. GPU time is taken to grow
+// with the pixel count, so a correction by a factor f in time is a factor sqrt(f) in scale.
+// Hysteresis keeps the scale steady: it only drops after DOWN_FRAMES frames in a row over the
+// target and only rises after UP_FRAMES frames in a row under headroom * target, and it rises
+// in small steps. Between those two thresholds it does not move at all.
+class ResolutionScaler
+{
+public:
+    static const unsigned int DOWN_FRAMES = 3;
+    static const unsigned int UP_FRAMES = 30;
+
+    ResolutionScaler(float minScale, float maxScale, double targetMs)
+        : minScale(minScale), maxScale(maxScale), targetMs(targetMs), headroom(0.8), scale(maxScale), averageMs(0.0), over(0), under(0)
+    {
+    }
+
+    float Scale() const { return scale; }
+    double AverageMs() const { return averageMs; }
+    double TargetMs() const { return targetMs; }
+
+    // Feeds one GPU frame time; returns true when the scale changed
+    bool Update(double gpuMs)
+    {
+        averageMs = averageMs > 0.0 ? averageMs + 0.2 * (gpuMs - averageMs) : gpuMs;
+        over = averageMs > targetMs ? over + 1 : 0;
+        under = averageMs < targetMs * headroom ? under + 1 : 0;
+
+        float next = scale;
+        if (over >= DOWN_FRAMES)
+            next = scale * (float)std::sqrt(targetMs * headroom / averageMs);
+        else if (under >= UP_FRAMES)
+            next = scale * std::min(1.1f, (float)std::sqrt(targetMs * headroom / averageMs));
+        next = std::max(minScale, std::min(maxScale, next));
+        if (std::fabs(next - scale) < 0.01f)
+            return false;
+
+        // the average still holds frames of the old scale; predict it for the new one so the
+        // same overload is not corrected twice
+        averageMs *= (next * next) / (scale * scale);
+        scale = next;
+        over = 0;
+        under = 0;
+        return true;
+    }
+
+private:
+    float minScale, maxScale;
+    double targetMs, headroom;
+    float scale;
+    double averageMs;
+    unsigned int over, under;
+};
+
+#endif
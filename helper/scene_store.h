@@ -0,0 +1,98 @@
+#ifndef SCENE_STORE_H
+#define SCENE_STORE_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+// The unit cube in main.cpp spans [-0.5, 0.5] on x/y but [-1, 1] on z, so a box's world
+// half extent is its scale times this.
+const glm::vec3 CUBE_HALF_EXTENT = glm::vec3(0.5f, 0.5f, 1.0f);
+
+// One box read from data.txt
+struct SceneBox
+{
+    glm::vec3 Scale;
+    glm::vec3 Position;
+    glm::vec3 Color;
+    int Texture;
+
+    glm::vec3 Min() const { return Position - Scale * CUBE_HALF_EXTENT; }
+    glm::vec3 Max() const { return Position + Scale * CUBE_HALF_EXTENT; }
+};
+
+// A box that was added or modified, with the bounds it had before so consumers can
+// invalidate whatever the old footprint covered. Added boxes have an empty OldMin > OldMax.
+struct SceneChange
+{
+    unsigned int Index;
+    glm::vec3 OldMin;
+    glm::vec3 OldMax;
+};
+
+// Owns every box in the scene. Each edit bumps Version and is appended to a bounded change
+// log, so derived structures can catch up incrementally instead of rebuilding from scratch.
+class SceneStore
+{
+public:
+    SceneStore() : version(0), logStart(0)
+    {
+    }
+
+    unsigned int Add(const SceneBox &box)
+    {
+        boxes.push_back(box);
+        record((unsigned int)boxes.size() - 1, glm::vec3(1.0f), glm::vec3(-1.0f));
+        return (unsigned int)boxes.size() - 1;
+    }
+
+    // Replaces box i, e.g. to move or resize it
+    void Set(unsigned int i, const SceneBox &box)
+    {
+        record(i, boxes[i].Min(), boxes[i].Max());
+        boxes[i] = box;
+    }
+
+    const SceneBox& operator[](unsigned int i) const { return boxes[i]; }
+    unsigned int Size() const { return (unsigned int)boxes.size(); }
+
+    // Incremented on every edit; equal versions mean an unchanged scene
+    unsigned long Version() const { return version; }
+
+    // Appends every change made after sinceVersion to out. Returns false when the log no longer
+    // reaches back that far, in which case the caller has to rebuild from the full box list.
+    bool ChangesSince(unsigned long sinceVersion, std::vector<SceneChange> &out) const
+    {
+        if (sinceVersion < logStart)
+            return false;
+        for (unsigned long v = sinceVersion; v < version; ++v)
+            out.push_back(changes[v - logStart]);
+        return true;
+    }
+
+private:
+    static const unsigned int MAX_LOGGED_CHANGES = 1024;
+
+    std::vector<SceneBox> boxes;
+    std::vector<SceneChange> changes;
+    unsigned long version;
+    unsigned long logStart; // version of changes[0]
+
+    void record(unsigned int index, glm::vec3 oldMin, glm::vec3 oldMax)
+    {
+        if (changes.size() == MAX_LOGGED_CHANGES)
+        {
+            // drop the older half at once rather than shifting the log on every edit
+            changes.erase(changes.begin(), changes.begin() + MAX_LOGGED_CHANGES / 2);
+            logStart += MAX_LOGGED_CHANGES / 2;
+        }
+        SceneChange change;
+        change.Index = index;
+        change.OldMin = oldMin;
+        change.OldMax = oldMax;
+        changes.push_back(change);
+        version++;
+    }
+};
+
+#endif
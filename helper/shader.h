@@ -70,6 +70,23 @@ public:
         glDeleteShader(fragment);
 
     }
+    // transform feedback program: vertex and geometry shader, no fragment stage; the geometry
+    // shader outputs named in varyings are captured interleaved into the bound buffer
+    // ------------------------------------------------------------------------
+    Shader(const char* vertexPath, const char* geometryPath, const char* const* varyings, int varyingCount)
+    {
+        unsigned int vertex = compile(GL_VERTEX_SHADER, vertexPath, "VERTEX");
+        unsigned int geometry = compile(GL_GEOMETRY_SHADER, geometryPath, "GEOMETRY");
+        ID = glCreateProgram();
+        glAttachShader(ID, vertex);
+        glAttachShader(ID, geometry);
+        // must be declared before linking
+        glTransformFeedbackVaryings(ID, varyingCount, varyings, GL_INTERLEAVED_ATTRIBS);
+        glLinkProgram(ID);
+        checkCompileErrors(ID, "PROGRAM");
+        glDeleteShader(vertex);
+        glDeleteShader(geometry);
+    }
     // activate the shader
     // ------------------------------------------------------------------------
     void use() const
@@ -93,6 +110,11 @@ public:
         glUniform1f(glGetUniformLocation(ID, name.c_str()), value); 
     }
     // ------------------------------------------------------------------------
+    void setIVec2(const std::string &name, int x, int y) const
+    { 
+        glUniform2i(glGetUniformLocation(ID, name.c_str()), x, y); 
+    }
+    // ------------------------------------------------------------------------
     void setVec2(const std::string &name, const glm::vec2 &value) const
     { 
         glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); 
@@ -136,6 +158,32 @@ public:
     }
 
 private:
+    // reads and compiles one stage
+    // ------------------------------------------------------------------------
+    unsigned int compile(GLenum type, const char* path, const std::string &name)
+    {
+        std::string code;
+        std::ifstream file;
+        file.exceptions (std::ifstream::failbit | std::ifstream::badbit);
+        try 
+        {
+            file.open(path);
+            std::stringstream stream;
+            stream << file.rdbuf();
+            file.close();
+            code = stream.str();
+        }
+        catch (std::ifstream::failure e)
+        {
+            std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
+        }
+        const char* source = code.c_str();
+        unsigned int shader = glCreateShader(type);
+        glShaderSource(shader, 1, &source, NULL);
+        glCompileShader(shader);
+        checkCompileErrors(shader, name);
+        return shader;
+    }
     // utility function for checking shader compilation/linking errors.
     // ------------------------------------------------------------------------
     void checkCompileErrors(GLuint shader, std::string type)
@@ -0,0 +1,82 @@
+#ifndef SIMULATION_CLOCK_H
+#define SIMULATION_CLOCK_H
+
+#include <cmath>
+
+// Fixed-step simulation clock. Real time is fed in with Advance(), which accumulates it and
+// reports how many whole steps of Step() seconds are due; the leftover fraction becomes
+// Alpha(), the blend factor between the previous and the current simulated state that the
+// renderer interpolates with. Time is kept as a step count in double precision so it does
+// not drift however long the program runs. The clock only depends on the time values it is
+// given, so it can drive a simulation on any thread at any rate independent of rendering.
+// While paused the accumulator is frozen, so Alpha() holds still, and the time spent paused is
+// never fed in.
+class SimulationClock
+{
+public:
+    SimulationClock(double step, unsigned int maxStepsPerAdvance)
+        : step(step), maxSteps(maxStepsPerAdvance), steps(0), accumulator(0.0), last(0.0), started(false), paused(false), dropped(0.0)
+    {
+    }
+
+    // Consumes real time up to now (seconds) and returns the number of steps to simulate.
+    // After a long stall at most maxStepsPerAdvance steps are returned and the rest of the
+    // backlog is dropped, so a slow frame cannot snowball into ever longer catch-up frames.
+    // Returns 0 without consuming anything while paused.
+    unsigned int Advance(double now)
+    {
+        if (paused)
+            return 0;
+        if (!started)
+        {
+            last = now;
+            started = true;
+        }
+        accumulator += now - last;
+        last = now;
+
+        unsigned int due = (unsigned int)(accumulator / step);
+        if (due > maxSteps)
+        {
+            dropped += (due - maxSteps) * step;
+            accumulator -= (due - maxSteps) * step;
+            due = maxSteps;
+        }
+        accumulator -= due * step;
+        steps += due;
+        return due;
+    }
+
+    // Stops consuming real time, the simulated state and Alpha() stay where they are
+    void Pause() { paused = true; }
+
+    // Continues from now (seconds), the time since Pause() is skipped rather than caught up
+    void Resume(double now)
+    {
+        paused = false;
+        last = now;
+    }
+
+    bool Paused() const { return paused; }
+
+    // Simulated time of the latest step, seconds
+    double Time() const { return steps * step; }
+    double Step() const { return step; }
+    unsigned long long Steps() const { return steps; }
+    // Real time thrown away because the simulation could not keep up, seconds
+    double Dropped() const { return dropped; }
+
+    // Leftover real time as a fraction of a step, in [0, 1). Rendering mix(previous, current,
+    // Alpha()) trails real time by one step but moves smoothly at any frame rate.
+    float Alpha() const { return (float)(accumulator / step); }
+
+private:
+    double step;
+    unsigned int maxSteps;
+    unsigned long long steps;
+    double accumulator, last;
+    bool started, paused;
+    double dropped;
+};
+
+#endif
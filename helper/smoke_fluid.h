@@ -0,0 +1,335 @@
+#ifndef SMOKE_FLUID_H
+#define SMOKE_FLUID_H
+
+#include <glm/glm.hpp>
+
+#include "job_system.h"
+
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Stam-style stable fluids on a cubic grid centred on a smoke source. Each Step() injects
+// smoke and velocity at the source, lifts smoke with buoyancy, advects everything
+// semi-Lagrangian and projects the velocity back to divergence free with Jacobi iterations.
+// Particles inside the grid then move with Sample(). The passes are split into z slabs
+// across the job system's workers. The projection's stencil rows (divergence, Jacobi sweeps,
+// gradient) run 4 cells at a time with SSE; advection gathers from arbitrary cells and stays
+// scalar. Each step is timed: when it keeps exceeding the budget the grid is resampled to a
+// coarser resolution, and it grows back when there is plenty of headroom.
+class SmokeFluid
+{
+public:
+    // Velocity blown out of the source, world units per cycle
+    glm::vec3 SourceVelocity;
+    // Upward acceleration per unit of smoke density
+    float Buoyancy;
+    // Radius of the injection sphere around the source, world units
+    float SourceRadius;
+    int PressureIterations;
+
+    SmokeFluid(JobSystem &jobs, glm::vec3 source, float size, int minResolution, int maxResolution, double budgetMs)
+        : SourceVelocity(0.0f, 0.15f, 0.3f), Buoyancy(0.03f), SourceRadius(0.3f), PressureIterations(20),
+          jobs(jobs), source(source), size(size), h(0.0f), n(0), minResolution(minResolution), maxResolution(maxResolution),
+          budgetMs(budgetMs), averageMs(0.0), overBudget(0), underBudget(0)
+    {
+        // the grid hangs below the middle so the plume has room to rise
+        origin = source - glm::vec3(size * 0.5f, size * 0.25f, size * 0.5f);
+        resize(maxResolution);
+    }
+
+    int Resolution() const { return n; }
+    double AverageStepMs() const { return averageMs; }
+
+    bool Contains(glm::vec3 position) const
+    {
+        glm::vec3 local = position - origin;
+        return local.x >= 0.0f && local.y >= 0.0f && local.z >= 0.0f &&
+               local.x < size && local.y < size && local.z < size;
+    }
+
+    // Trilinearly interpolated velocity at a world position, world units per cycle
+    glm::vec3 Sample(glm::vec3 position) const
+    {
+        glm::vec3 cell = (position - origin) / h - glm::vec3(0.5f);
+        return glm::vec3(interpolate(u, cell.x, cell.y, cell.z),
+                         interpolate(v, cell.x, cell.y, cell.z),
+                         interpolate(w, cell.x, cell.y, cell.z));
+    }
+
+    // Advances the fluid by dt cycles and adapts the resolution to the time budget
+    void Step(float dt)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        addSources(dt);
+        u.swap(u0); v.swap(v0); w.swap(w0);
+        advect(u, u0, u0, v0, w0, dt);
+        advect(v, v0, u0, v0, w0, dt);
+        advect(w, w0, u0, v0, w0, dt);
+        project();
+        d.swap(d0);
+        advect(d, d0, u, v, w, dt);
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        adapt(ms);
+    }
+
+private:
+    JobSystem &jobs;
+    glm::vec3 source, origin;
+    float size, h;
+    int n, minResolution, maxResolution;
+    double budgetMs, averageMs;
+    int overBudget, underBudget;
+    std::vector<float> u, v, w, u0, v0, w0, d, d0, p, p0, div;
+
+    int index(int x, int y, int z) const { return x + n * (y + n * z); }
+
+    void resize(int resolution)
+    {
+        std::vector<float> oldU, oldV, oldW, oldD;
+        oldU.swap(u); oldV.swap(v); oldW.swap(w); oldD.swap(d);
+        int oldN = n;
+        float oldH = h;
+
+        n = resolution;
+        h = size / n;
+        int cells = n * n * n;
+        u.assign(cells, 0.0f); v.assign(cells, 0.0f); w.assign(cells, 0.0f); d.assign(cells, 0.0f);
+        u0.assign(cells, 0.0f); v0.assign(cells, 0.0f); w0.assign(cells, 0.0f); d0.assign(cells, 0.0f);
+        p.assign(cells, 0.0f); p0.assign(cells, 0.0f); div.assign(cells, 0.0f);
+
+        if (oldU.empty())
+            return;
+        // resample the old state so the plume survives a resolution change; interpolate()
+        // reads the grid through n and h, so they point at the old grid while sampling
+        int newN = n;
+        float newH = h;
+        n = oldN;
+        h = oldH;
+        std::vector<float> *oldFields[] = { &oldU, &oldV, &oldW, &oldD };
+        std::vector<float> *newFields[] = { &u, &v, &w, &d };
+        float scale = newH / oldH;
+        for (int f = 0; f < 4; ++f)
+            for (int z = 0; z < newN; ++z)
+                for (int y = 0; y < newN; ++y)
+                    for (int x = 0; x < newN; ++x)
+                        (*newFields[f])[x + newN * (y + newN * z)] = interpolate(*oldFields[f],
+                            (x + 0.5f) * scale - 0.5f, (y + 0.5f) * scale - 0.5f, (z + 0.5f) * scale - 0.5f);
+        n = newN;
+        h = newH;
+    }
+
+    void adapt(double ms)
+    {
+        averageMs = averageMs == 0.0 ? ms : averageMs * 0.9 + ms * 0.1;
+        overBudget = averageMs > budgetMs ? overBudget + 1 : 0;
+        underBudget = averageMs < budgetMs * 0.4 ? underBudget + 1 : 0;
+        if (overBudget >= 10 && n > minResolution)
+        {
+            resize(std::max(minResolution, n * 3 / 4));
+            averageMs = 0.0;
+            overBudget = 0;
+        }
+        else if (underBudget >= 120 && n < maxResolution)
+        {
+            resize(std::min(maxResolution, n * 4 / 3));
+            averageMs = 0.0;
+            underBudget = 0;
+        }
+    }
+
+    // Runs body(z0, z1) over slabs of interior z rows, about one slab per worker
+    template <typename Body>
+    void forEachSlab(Body body)
+    {
+        unsigned int interior = n - 2;
+        unsigned int slab = (interior + jobs.WorkerCount() - 1) / jobs.WorkerCount();
+        jobs.ParallelFor(1, n - 1, slab, [&](unsigned int z0, unsigned int z1) { body((int)z0, (int)z1); });
+    }
+
+    float interpolate(const std::vector<float> &field, float x, float y, float z) const
+    {
+        x = glm::clamp(x, 0.0f, n - 1.001f);
+        y = glm::clamp(y, 0.0f, n - 1.001f);
+        z = glm::clamp(z, 0.0f, n - 1.001f);
+        int x0 = (int)x, y0 = (int)y, z0 = (int)z;
+        float tx = x - x0, ty = y - y0, tz = z - z0;
+        int i = index(x0, y0, z0);
+        int sy = n, sz = n * n;
+        float c00 = glm::mix(field[i], field[i + 1], tx);
+        float c10 = glm::mix(field[i + sy], field[i + sy + 1], tx);
+        float c01 = glm::mix(field[i + sz], field[i + sz + 1], tx);
+        float c11 = glm::mix(field[i + sy + sz], field[i + sy + sz + 1], tx);
+        return glm::mix(glm::mix(c00, c10, ty), glm::mix(c01, c11, ty), tz);
+    }
+
+    void addSources(float dt)
+    {
+        glm::vec3 centre = (source - origin) / h - glm::vec3(0.5f);
+        float radius = std::max(SourceRadius / h, 1.0f);
+        forEachSlab([&](int z0, int z1) {
+            for (int z = z0; z < z1; ++z)
+                for (int y = 1; y < n - 1; ++y)
+                    for (int x = 1; x < n - 1; ++x)
+                    {
+                        int i = index(x, y, z);
+                        glm::vec3 offset = glm::vec3((float)x, (float)y, (float)z) - centre;
+                        if (glm::dot(offset, offset) < radius * radius)
+                        {
+                            d[i] = 1.0f;
+                            u[i] = SourceVelocity.x;
+                            v[i] = SourceVelocity.y;
+                            w[i] = SourceVelocity.z;
+                        }
+                        v[i] += Buoyancy * d[i] * dt;
+                    }
+        });
+    }
+
+    // Semi-Lagrangian: trace each cell centre back along the velocity and sample the old field
+    void advect(std::vector<float> &field, const std::vector<float> &previous,
+                const std::vector<float> &velU, const std::vector<float> &velV, const std::vector<float> &velW, float dt)
+    {
+        float scale = dt / h;
+        forEachSlab([&](int z0, int z1) {
+            for (int z = z0; z < z1; ++z)
+                for (int y = 1; y < n - 1; ++y)
+                    for (int x = 1; x < n - 1; ++x)
+                    {
+                        int i = index(x, y, z);
+                        field[i] = interpolate(previous, x - velU[i] * scale, y - velV[i] * scale, z - velW[i] * scale);
+                    }
+        });
+        setBoundary(field);
+    }
+
+    // Removes the divergent part of the velocity: solve laplace(p) = div(vel), vel -= grad(p)
+    void project()
+    {
+        forEachSlab([&](int z0, int z1) {
+            for (int z = z0; z < z1; ++z)
+                for (int y = 1; y < n - 1; ++y)
+                    divergenceRow(index(1, y, z), n - 2);
+        });
+        setBoundary(div);
+        std::fill(p.begin(), p.end(), 0.0f);
+
+        for (int iteration = 0; iteration < PressureIterations; ++iteration)
+        {
+            p0.swap(p);
+            forEachSlab([&](int z0, int z1) {
+                for (int z = z0; z < z1; ++z)
+                    for (int y = 1; y < n - 1; ++y)
+                        jacobiRow(index(1, y, z), n - 2);
+            });
+            setBoundary(p);
+        }
+
+        forEachSlab([&](int z0, int z1) {
+            for (int z = z0; z < z1; ++z)
+                for (int y = 1; y < n - 1; ++y)
+                    gradientRow(index(1, y, z), n - 2);
+        });
+        setBoundary(u);
+        setBoundary(v);
+        setBoundary(w);
+    }
+
+    // Divergence of the velocity over count cells of a row starting at i, scaled for the solve
+    void divergenceRow(int i, int count)
+    {
+        const float *velU = u.data(), *velV = v.data(), *velW = w.data();
+        float *result = div.data();
+        int sy = n, sz = n * n;
+        int end = i + count;
+        float scale = -0.5f * h;
+#ifdef __SSE2__
+        const __m128 scales = _mm_set1_ps(scale);
+        for (; i + 4 <= end; i += 4)
+        {
+            __m128 sum = _mm_sub_ps(_mm_loadu_ps(velU + i + 1), _mm_loadu_ps(velU + i - 1));
+            sum = _mm_add_ps(sum, _mm_sub_ps(_mm_loadu_ps(velV + i + sy), _mm_loadu_ps(velV + i - sy)));
+            sum = _mm_add_ps(sum, _mm_sub_ps(_mm_loadu_ps(velW + i + sz), _mm_loadu_ps(velW + i - sz)));
+            _mm_storeu_ps(result + i, _mm_mul_ps(sum, scales));
+        }
+#endif
+        for (; i < end; ++i)
+            result[i] = scale * (velU[i + 1] - velU[i - 1] + velV[i + sy] - velV[i - sy] + velW[i + sz] - velW[i - sz]);
+    }
+
+    // Subtracts the pressure gradient from the velocity over count cells of a row starting at i
+    void gradientRow(int i, int count)
+    {
+        const float *pressure = p.data();
+        float *velU = u.data(), *velV = v.data(), *velW = w.data();
+        int sy = n, sz = n * n;
+        int end = i + count;
+        float scale = 0.5f / h;
+#ifdef __SSE2__
+        const __m128 scales = _mm_set1_ps(scale);
+        for (; i + 4 <= end; i += 4)
+        {
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(pressure + i + 1), _mm_loadu_ps(pressure + i - 1));
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(pressure + i + sy), _mm_loadu_ps(pressure + i - sy));
+            __m128 dz = _mm_sub_ps(_mm_loadu_ps(pressure + i + sz), _mm_loadu_ps(pressure + i - sz));
+            _mm_storeu_ps(velU + i, _mm_sub_ps(_mm_loadu_ps(velU + i), _mm_mul_ps(scales, dx)));
+            _mm_storeu_ps(velV + i, _mm_sub_ps(_mm_loadu_ps(velV + i), _mm_mul_ps(scales, dy)));
+            _mm_storeu_ps(velW + i, _mm_sub_ps(_mm_loadu_ps(velW + i), _mm_mul_ps(scales, dz)));
+        }
+#endif
+        for (; i < end; ++i)
+        {
+            velU[i] -= scale * (pressure[i + 1] - pressure[i - 1]);
+            velV[i] -= scale * (pressure[i + sy] - pressure[i - sy]);
+            velW[i] -= scale * (pressure[i + sz] - pressure[i - sz]);
+        }
+    }
+
+    // One Jacobi sweep over count cells of a row starting at i: p = (div + sum of 6 neighbours) / 6
+    void jacobiRow(int i, int count)
+    {
+        const float *previous = p0.data();
+        const float *divergence = div.data();
+        float *result = p.data();
+        int sy = n, sz = n * n;
+        int end = i + count;
+#ifdef __SSE2__
+        const __m128 sixth = _mm_set1_ps(1.0f / 6.0f);
+        for (; i + 4 <= end; i += 4)
+        {
+            __m128 sum = _mm_add_ps(_mm_loadu_ps(previous + i - 1), _mm_loadu_ps(previous + i + 1));
+            sum = _mm_add_ps(sum, _mm_add_ps(_mm_loadu_ps(previous + i - sy), _mm_loadu_ps(previous + i + sy)));
+            sum = _mm_add_ps(sum, _mm_add_ps(_mm_loadu_ps(previous + i - sz), _mm_loadu_ps(previous + i + sz)));
+            sum = _mm_add_ps(sum, _mm_loadu_ps(divergence + i));
+            _mm_storeu_ps(result + i, _mm_mul_ps(sum, sixth));
+        }
+#endif
+        for (; i < end; ++i)
+            result[i] = (divergence[i] + previous[i - 1] + previous[i + 1] + previous[i - sy] + previous[i + sy] +
+                         previous[i - sz] + previous[i + sz]) * (1.0f / 6.0f);
+    }
+
+    // Open boundary: every face cell copies its interior neighbour
+    void setBoundary(std::vector<float> &field)
+    {
+        for (int a = 0; a < n; ++a)
+            for (int b = 0; b < n; ++b)
+            {
+                field[index(0, a, b)] = field[index(1, a, b)];
+                field[index(n - 1, a, b)] = field[index(n - 2, a, b)];
+                field[index(a, 0, b)] = field[index(a, 1, b)];
+                field[index(a, n - 1, b)] = field[index(a, n - 2, b)];
+                field[index(a, b, 0)] = field[index(a, b, 1)];
+                field[index(a, b, n - 1)] = field[index(a, b, n - 2)];
+            }
+    }
+};
+
+#endif
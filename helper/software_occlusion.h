@@ -0,0 +1,359 @@
+#ifndef SOFTWARE_OCCLUSION_H
+#define SOFTWARE_OCCLUSION_H
+
+#include <glm/glm.hpp>
+
+#include "job_system.h"
+#include "scene_store.h"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define SOFTWARE_OCCLUSION_SSE
+#endif
+
+// CPU occlusion culling for boxes. The faces of the largest boxes close to the camera are
+// rasterized as occluders into a small depth buffer, several pixels of a row at once with SIMD;
+// a max pyramid (every texel holds the farthest depth below it) is built over it, and every other
+// box is tested by comparing its nearest depth against the pyramid texels covering its screen
+// rectangle. Everything runs on the job system's workers, on the simulation thread, so it
+// overlaps the GPU drawing the previous frame. Depths are NDC z, smaller is nearer. The test is
+// conservative, a box is only dropped when it is certainly hidden: occluders only write the
+// pixels a face covers completely, with the face's farthest depth inside the pixel, and a box is
+// tested against every pixel its rectangle touches.
+class SoftwareOcclusion
+{
+public:
+    static const unsigned int MAX_OCCLUDERS = 64;
+    static const unsigned int BAND_ROWS = 8;   // rows rasterized per job
+    static const unsigned int TEST_GRAIN = 256; // boxes tested per job
+    static constexpr float MIN_OCCLUDER_SIZE = 0.05f; // occluder radius over distance
+
+    // width is rounded up to a multiple of the SIMD width
+    SoftwareOcclusion(unsigned int width, unsigned int height)
+        : width((width + LANES - 1) / LANES * LANES), height(height), occluderCount(0)
+    {
+        unsigned int w = this->width, h = this->height;
+        while (true)
+        {
+            levels.push_back(Level());
+            levels.back().Width = w;
+            levels.back().Height = h;
+            levels.back().Depth.resize(w * h);
+            if (w == 1 && h == 1)
+                break;
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+        }
+    }
+
+    unsigned int Width() const { return width; }
+    unsigned int Height() const { return height; }
+    unsigned int OccluderCount() const { return occluderCount; }
+    // depth buffer row by row, level 0 of the pyramid
+    const std::vector<float>& Depth() const { return levels[0].Depth; }
+
+    // Picks the occluders among candidates (usually the boxes that survived frustum culling),
+    // rasterizes them and builds the pyramid
+    void Render(const glm::mat4 &viewProjection, const glm::vec3 &eye, const SceneStore &scene, const std::vector<unsigned int> &candidates, JobSystem &jobs)
+    {
+        this->viewProjection = viewProjection;
+        selectOccluders(eye, scene, candidates);
+        setupFaces(scene);
+
+        std::vector<float> &depth = levels[0].Depth;
+        std::fill(depth.begin(), depth.end(), 1.0f);
+        // every band of rows walks all faces, so no two jobs write the same pixel
+        jobs.ParallelFor(0, height, BAND_ROWS, [&](unsigned int begin, unsigned int end) {
+            for (unsigned int f = 0; f < faces.size(); ++f)
+                rasterize(faces[f], begin, end);
+        });
+        buildPyramid(jobs);
+    }
+
+    // Removes the boxes hidden behind the occluders from visible, keeping the order
+    void Cull(const SceneStore &scene, std::vector<unsigned int> &visible, JobSystem &jobs)
+    {
+        hidden.resize(visible.size());
+        jobs.ParallelFor(0, (unsigned int)visible.size(), TEST_GRAIN, [&](unsigned int begin, unsigned int end) {
+            for (unsigned int v = begin; v < end; ++v)
+                hidden[v] = occluded(scene[visible[v]]);
+        });
+        unsigned int kept = 0;
+        for (unsigned int v = 0; v < visible.size(); ++v)
+            if (!hidden[v])
+                visible[kept++] = visible[v];
+        visible.resize(kept);
+    }
+
+private:
+#if defined(__AVX__)
+    typedef __m256 Lanes;
+    static const unsigned int LANES = 8;
+    static Lanes splat(float v) { return _mm256_set1_ps(v); }
+    static Lanes ramp() { return _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f); }
+    static Lanes add(Lanes a, Lanes b) { return _mm256_add_ps(a, b); }
+    static Lanes mul(Lanes a, Lanes b) { return _mm256_mul_ps(a, b); }
+    static Lanes load(const float *p) { return _mm256_loadu_ps(p); }
+    static void store(float *p, Lanes v) { _mm256_storeu_ps(p, v); }
+    static Lanes inside(Lanes a, Lanes b, Lanes c, Lanes d)
+    {
+        Lanes zero = _mm256_setzero_ps();
+        return _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(a, zero, _CMP_GE_OQ), _mm256_cmp_ps(b, zero, _CMP_GE_OQ)),
+                             _mm256_and_ps(_mm256_cmp_ps(c, zero, _CMP_GE_OQ), _mm256_cmp_ps(d, zero, _CMP_GE_OQ)));
+    }
+    static bool any(Lanes mask) { return _mm256_movemask_ps(mask) != 0; }
+    static Lanes nearer(Lanes mask, Lanes depth, Lanes old) { return _mm256_blendv_ps(old, _mm256_min_ps(depth, old), mask); }
+#elif defined(SOFTWARE_OCCLUSION_SSE)
+    typedef __m128 Lanes;
+    static const unsigned int LANES = 4;
+    static Lanes splat(float v) { return _mm_set1_ps(v); }
+    static Lanes ramp() { return _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f); }
+    static Lanes add(Lanes a, Lanes b) { return _mm_add_ps(a, b); }
+    static Lanes mul(Lanes a, Lanes b) { return _mm_mul_ps(a, b); }
+    static Lanes load(const float *p) { return _mm_loadu_ps(p); }
+    static void store(float *p, Lanes v) { _mm_storeu_ps(p, v); }
+    static Lanes inside(Lanes a, Lanes b, Lanes c, Lanes d)
+    {
+        Lanes zero = _mm_setzero_ps();
+        return _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(a, zero), _mm_cmpge_ps(b, zero)), _mm_and_ps(_mm_cmpge_ps(c, zero), _mm_cmpge_ps(d, zero)));
+    }
+    static bool any(Lanes mask) { return _mm_movemask_ps(mask) != 0; }
+    static Lanes nearer(Lanes mask, Lanes depth, Lanes old) { return _mm_or_ps(_mm_and_ps(mask, _mm_min_ps(depth, old)), _mm_andnot_ps(mask, old)); }
+#else
+    typedef float Lanes;
+    static const unsigned int LANES = 1;
+    static Lanes splat(float v) { return v; }
+    static Lanes ramp() { return 0.0f; }
+    static Lanes add(Lanes a, Lanes b) { return a + b; }
+    static Lanes mul(Lanes a, Lanes b) { return a * b; }
+    static Lanes load(const float *p) { return *p; }
+    static void store(float *p, Lanes v) { *p = v; }
+    static Lanes inside(Lanes a, Lanes b, Lanes c, Lanes d) { return a >= 0.0f && b >= 0.0f && c >= 0.0f && d >= 0.0f ? 1.0f : 0.0f; }
+    static bool any(Lanes mask) { return mask != 0.0f; }
+    static Lanes nearer(Lanes mask, Lanes depth, Lanes old) { return mask != 0.0f ? std::min(depth, old) : old; }
+#endif
+
+    // A box face in screen space, a convex quad: four edge functions and a depth plane, each
+    // a * x + b * y + c at pixel centres, plus the pixel rectangle it spans. The edges are moved
+    // inwards by half a pixel's extent along their normal, so they are non-negative only for
+    // pixels the face covers completely; the depth plane is moved back to the farthest depth
+    // inside the pixel.
+    struct Face
+    {
+        float Edge[4][3];
+        float Depth[3];
+        int MinX, MinY, MaxX, MaxY;
+    };
+
+    struct Level
+    {
+        unsigned int Width, Height;
+        std::vector<float> Depth;
+    };
+
+    unsigned int width, height;
+    glm::mat4 viewProjection;
+    std::vector<Level> levels;
+    std::vector<std::pair<float, unsigned int> > scored;
+    unsigned int occluders[MAX_OCCLUDERS];
+    unsigned int occluderCount;
+    std::vector<Face> faces;
+    std::vector<unsigned char> hidden;
+
+    // The largest boxes relative to their distance, the ones that hide the most
+    void selectOccluders(const glm::vec3 &eye, const SceneStore &scene, const std::vector<unsigned int> &candidates)
+    {
+        scored.clear();
+        for (unsigned int c = 0; c < candidates.size(); ++c)
+        {
+            const SceneBox &box = scene[candidates[c]];
+            float radius = glm::length(box.Scale * CUBE_HALF_EXTENT);
+            float size = radius / std::max(glm::length(box.Position - eye), 1e-3f);
+            if (size >= MIN_OCCLUDER_SIZE)
+                scored.push_back(std::make_pair(-size, candidates[c]));
+        }
+        occluderCount = std::min((unsigned int)scored.size(), (unsigned int)MAX_OCCLUDERS);
+        std::nth_element(scored.begin(), scored.begin() + occluderCount, scored.end());
+        for (unsigned int o = 0; o < occluderCount; ++o)
+            occluders[o] = scored[o].second;
+    }
+
+    // Projects the 6 faces of every occluder, whole quads so no pixel along a diagonal is lost
+    // between two triangles; boxes reaching behind the near plane are left out rather than clipped
+    void setupFaces(const SceneStore &scene)
+    {
+        static const int FACES[6][4] = {
+            { 0, 2, 6, 4 }, { 1, 3, 7, 5 }, { 0, 1, 5, 4 }, { 2, 3, 7, 6 }, { 0, 1, 3, 2 }, { 4, 5, 7, 6 }
+        };
+        faces.clear();
+        for (unsigned int o = 0; o < occluderCount; ++o)
+        {
+            glm::vec3 screen[8];
+            if (!project(scene[occluders[o]], screen))
+                continue;
+            for (int f = 0; f < 6; ++f)
+                addFace(screen[FACES[f][0]], screen[FACES[f][1]], screen[FACES[f][2]], screen[FACES[f][3]]);
+        }
+    }
+
+    // Corners in pixels and NDC depth, corner bit 0/1/2 selects max x/y/z; false when a corner
+    // is behind the camera
+    bool project(const SceneBox &box, glm::vec3 screen[8]) const
+    {
+        glm::vec3 lo = box.Min(), hi = box.Max();
+        for (int k = 0; k < 8; ++k)
+        {
+            glm::vec4 clip = viewProjection * glm::vec4((k & 1) ? hi.x : lo.x, (k & 2) ? hi.y : lo.y, (k & 4) ? hi.z : lo.z, 1.0f);
+            if (clip.w <= 1e-4f)
+                return false;
+            glm::vec3 ndc = glm::vec3(clip) / clip.w;
+            screen[k] = glm::vec3((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height, ndc.z);
+        }
+        return true;
+    }
+
+    // Corners a, b, c, d in order around a face, which projects to a convex quad
+    void addFace(glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 d)
+    {
+        glm::vec3 v[4] = { a, b, c, d };
+        // twice the signed area, shoelace
+        float area = 0.0f;
+        for (int e = 0; e < 4; ++e)
+            area += v[e].x * v[(e + 1) % 4].y - v[(e + 1) % 4].x * v[e].y;
+        if (std::fabs(area) < 1e-6f)
+            return;
+        // back and front faces both go in, wound the same way so inside is positive
+        if (area < 0.0f)
+        {
+            std::swap(v[1], v[3]);
+            area = -area;
+        }
+        Face face;
+        face.MinX = std::max(0, (int)std::floor(std::min(std::min(a.x, b.x), std::min(c.x, d.x))));
+        face.MinY = std::max(0, (int)std::floor(std::min(std::min(a.y, b.y), std::min(c.y, d.y))));
+        face.MaxX = std::min((int)width - 1, (int)std::floor(std::max(std::max(a.x, b.x), std::max(c.x, d.x))));
+        face.MaxY = std::min((int)height - 1, (int)std::floor(std::max(std::max(a.y, b.y), std::max(c.y, d.y))));
+        if (face.MinX > face.MaxX || face.MinY > face.MaxY)
+            return;
+        for (int e = 0; e < 4; ++e)
+        {
+            glm::vec3 p = v[e], q = v[(e + 1) % 4];
+            // positive on the inner side of the edge p -> q; its smallest value over a pixel is
+            // the value at the centre minus half of |a| + |b|
+            face.Edge[e][0] = p.y - q.y;
+            face.Edge[e][1] = q.x - p.x;
+            face.Edge[e][2] = p.x * q.y - p.y * q.x - 0.5f * (std::fabs(face.Edge[e][0]) + std::fabs(face.Edge[e][1]));
+        }
+        // depth is affine in screen space over a planar face: solve z = dx * x + dy * y + z0
+        // through three corners, of the largest triangle so a sliver does not amplify error
+        glm::vec3 p = v[0], q = v[1], r = v[2];
+        float triangle = (q.x - p.x) * (r.y - p.y) - (q.y - p.y) * (r.x - p.x);
+        float other = (r.x - p.x) * (v[3].y - p.y) - (r.y - p.y) * (v[3].x - p.x);
+        if (other > triangle)
+        {
+            q = v[2];
+            r = v[3];
+            triangle = other;
+        }
+        if (triangle < 1e-6f)
+            return;
+        float dx = ((q.z - p.z) * (r.y - p.y) - (r.z - p.z) * (q.y - p.y)) / triangle;
+        float dy = ((r.z - p.z) * (q.x - p.x) - (q.z - p.z) * (r.x - p.x)) / triangle;
+        face.Depth[0] = dx;
+        face.Depth[1] = dy;
+        // the farthest depth over a pixel lies half of |dx| + |dy| behind the one at its centre
+        face.Depth[2] = p.z - dx * p.x - dy * p.y + 0.5f * (std::fabs(dx) + std::fabs(dy));
+        faces.push_back(face);
+    }
+
+    // Rasterizes the rows of t in [rowBegin, rowEnd), LANES pixels per step
+    void rasterize(const Face &t, unsigned int rowBegin, unsigned int rowEnd)
+    {
+        int y0 = std::max(t.MinY, (int)rowBegin), y1 = std::min(t.MaxY, (int)rowEnd - 1);
+        int x0 = t.MinX / (int)LANES * (int)LANES;
+        float *depth = levels[0].Depth.data();
+        Lanes step = ramp();
+        for (int y = y0; y <= y1; ++y)
+        {
+            float py = y + 0.5f;
+            for (int x = x0; x <= t.MaxX; x += LANES)
+            {
+                Lanes px = add(splat(x + 0.5f), step);
+                Lanes e0 = add(mul(splat(t.Edge[0][0]), px), splat(t.Edge[0][1] * py + t.Edge[0][2]));
+                Lanes e1 = add(mul(splat(t.Edge[1][0]), px), splat(t.Edge[1][1] * py + t.Edge[1][2]));
+                Lanes e2 = add(mul(splat(t.Edge[2][0]), px), splat(t.Edge[2][1] * py + t.Edge[2][2]));
+                Lanes e3 = add(mul(splat(t.Edge[3][0]), px), splat(t.Edge[3][1] * py + t.Edge[3][2]));
+                Lanes mask = inside(e0, e1, e2, e3);
+                if (!any(mask))
+                    continue;
+                Lanes z = add(mul(splat(t.Depth[0]), px), splat(t.Depth[1] * py + t.Depth[2]));
+                float *row = depth + y * width + x;
+                store(row, nearer(mask, z, load(row)));
+            }
+        }
+    }
+
+    // Every level keeps the farthest depth of the 2x2 texels below it
+    void buildPyramid(JobSystem &jobs)
+    {
+        for (unsigned int l = 1; l < levels.size(); ++l)
+        {
+            const Level &fine = levels[l - 1];
+            Level &coarse = levels[l];
+            jobs.ParallelFor(0, coarse.Height, BAND_ROWS, [&](unsigned int begin, unsigned int end) {
+                for (unsigned int y = begin; y < end; ++y)
+                {
+                    unsigned int fy0 = 2 * y, fy1 = std::min(2 * y + 1, fine.Height - 1);
+                    for (unsigned int x = 0; x < coarse.Width; ++x)
+                    {
+                        unsigned int fx0 = 2 * x, fx1 = std::min(2 * x + 1, fine.Width - 1);
+                        coarse.Depth[y * coarse.Width + x] = std::max(
+                            std::max(fine.Depth[fy0 * fine.Width + fx0], fine.Depth[fy0 * fine.Width + fx1]),
+                            std::max(fine.Depth[fy1 * fine.Width + fx0], fine.Depth[fy1 * fine.Width + fx1]));
+                    }
+                }
+            });
+        }
+    }
+
+    // True when the whole screen rectangle of box lies behind the occluders
+    bool occluded(const SceneBox &box) const
+    {
+        glm::vec3 screen[8];
+        if (occluderCount == 0 || !project(box, screen))
+            return false;
+        float minX = screen[0].x, minY = screen[0].y, maxX = minX, maxY = minY, nearest = screen[0].z;
+        for (int k = 1; k < 8; ++k)
+        {
+            minX = std::min(minX, screen[k].x);
+            minY = std::min(minY, screen[k].y);
+            maxX = std::max(maxX, screen[k].x);
+            maxY = std::max(maxY, screen[k].y);
+            nearest = std::min(nearest, screen[k].z);
+        }
+        // every pixel the rectangle touches, however little
+        int x0 = std::max(0, (int)std::floor(minX)), y0 = std::max(0, (int)std::floor(minY));
+        int x1 = std::min((int)width - 1, (int)std::floor(maxX)), y1 = std::min((int)height - 1, (int)std::floor(maxY));
+        if (x0 > x1 || y0 > y1)
+            return false;
+
+        // the level where the rectangle spans at most a few texels per axis
+        unsigned int l = 0;
+        while (l + 1 < levels.size() && std::max(x1 - x0, y1 - y0) >> l > 3)
+            ++l;
+        const Level &level = levels[l];
+        for (int y = y0 >> l; y <= y1 >> l; ++y)
+            for (int x = x0 >> l; x <= x1 >> l; ++x)
+                if (level.Depth[y * level.Width + x] >= nearest)
+                    return false;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+// Hands values from one producer thread to one consumer thread without either side ever
+// blocking the other. The producer fills Back() and Publish()es it, the consumer Acquire()s
+// the newest published value into Front(). The three slots rotate through a single atomic
+// word holding the index of the middle slot and a fresh bit, so each side owns its own slot
+// outright between exchanges and a value is never copied. A value published before the last
+// one was acquired is replaced: the consumer always gets the newest. The Wait functions only
+// exist to sleep instead of spin and are not needed for correctness.
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : middle(1), front(0), back(2)
+    {
+    }
+
+    // Producer side: the slot to fill; it keeps whatever the slot held two publishes ago
+    T& Back() { return slots[back]; }
+
+    void Publish()
+    {
+        unsigned int previous = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+        back = previous & INDEX;
+        notify();
+    }
+
+    // Producer side: sleeps until the last published value was acquired, at most timeout.
+    // Returns whether it was.
+    template <typename Duration>
+    bool WaitUntilConsumed(Duration timeout)
+    {
+        std::unique_lock<std::mutex> guard(mutex);
+        return changed.wait_for(guard, timeout, [this] { return !fresh(); });
+    }
+
+    // Consumer side: takes the newest published value if there is one
+    bool Acquire()
+    {
+        if (!fresh())
+            return false;
+        unsigned int previous = middle.exchange(front, std::memory_order_acq_rel);
+        front = previous & INDEX;
+        notify();
+        return true;
+    }
+
+    // Consumer side: sleeps until a value is published, at most timeout, then acquires it
+    template <typename Duration>
+    bool WaitAndAcquire(Duration timeout)
+    {
+        {
+            std::unique_lock<std::mutex> guard(mutex);
+            changed.wait_for(guard, timeout, [this] { return fresh(); });
+        }
+        return Acquire();
+    }
+
+    const T& Front() const { return slots[front]; }
+
+private:
+    static const unsigned int INDEX = 3;
+    static const unsigned int FRESH = 4;
+
+    T slots[3];
+    std::atomic<unsigned int> middle;
+    unsigned int front; // owned by the consumer
+    unsigned int back;  // owned by the producer
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    bool fresh() const
+    {
+        return (middle.load(std::memory_order_acquire) & FRESH) != 0;
+    }
+
+    void notify()
+    {
+        // taking the mutex orders the exchange before a waiter's predicate check
+        { std::lock_guard<std::mutex> guard(mutex); }
+        changed.notify_all();
+    }
+};
+
+#endif
@@ -11,18 +11,71 @@
 #define WORLD_FRONT -15.0
 #define WORLD_BACK 25.0
 
+#define SIMULATION_STEP (1.0 / 60.0) // seconds per simulation cycle, speeds below are per cycle
+#define MAX_CYCLES_PER_FRAME 8
+#define RAIN_GRAIN 256 // particles per job
+#define SMOKE_GRAIN 256
+#define DRAW_GRAIN 64 // boxes recorded per job
+
 #define NUMBER_OF_RAIN_PARTICLE 1000
 #define PARTICLE_MIN_SPEED 0.1
 #define PARTICLE_MAX_SPEED 0.5
 #define PARTICLE_SPEED 0.3
+#define OCCLUSION_CELL_SIZE 0.25f
+#define RAIN_STREAK_WIDTH 0.03f
+#define RAIN_STREAK_LENGTH 0.6f // streak length per unit of fall speed
 
-#define NUMBER_OF_SMOKE_PARTICLE 200
+#define NUMBER_OF_SMOKE_PARTICLE 400 // capacity of the pool shared by every smoke emitter
 #define START_X 5
 #define START_Y 0.5
 #define START_Z 18
+#define EXHAUST_EMIT_RATE 8 // particles per cycle
+#define CHIMNEY_EMIT_RATE 4
 #define SMOKE_MAX_LIFETIME 50
+#define SMOKE_SIZE 0.08f
+#define SMOKE_OPACITY 0.5f
+#define SMOKE_FLUID_SIZE 6.0f // edge of the fluid grid around the exhaust, world units
+#define SMOKE_FLUID_MIN_RESOLUTION 8
+#define SMOKE_FLUID_MAX_RESOLUTION 32
+#define SMOKE_FLUID_BUDGET_MS 2.0 // the grid coarsens when a step keeps taking longer
 #define LIFESPAN_PER_CYCLE 1
 
+#define FRAME_PACING PACING_VSYNC // 1 uncapped, 2 vsync, 3 fixed, 4 idle switch at runtime
+#define TARGET_FPS 60.0 // for PACING_FIXED
+#define FRAME_STATS_INTERVAL 5.0 // seconds between frame time reports
+
+#define DYNAMIC_RESOLUTION_MIN_SCALE 0.5f // of the window size, per axis
+#define DYNAMIC_RESOLUTION_MAX_SCALE 1.0f
+#define DYNAMIC_RESOLUTION_TARGET_MS 12.0 // GPU time per frame the scale aims for
+#define GPU_TIMER_QUERIES 4 // frames of timer queries in flight
+
+#define PARTICLE_RESOLUTION_DIVISOR 2 // rain and smoke are drawn at 1/2 or 1/4 of the scene resolution, 1 draws them at full
+#define OCCLUSION_CULLING OCCLUSION_SOFTWARE // O cycles off, software and hardware occlusion culling
+#define OCCLUSION_BUFFER_WIDTH 256 // CPU depth buffer the occluders are rasterized into
+#define OCCLUSION_BUFFER_HEIGHT 128
+#define OCCLUSION_GROUP_SIZE 32 // boxes sharing one hardware occlusion query
+#define GPU_CULLING false // G toggles; boxes are culled by a transform feedback pass and drawn instanced
+#define GPU_CULL_BUFFERS 3 // culled instance buffers in flight
+#define GPU_CULL_MARGIN 0.5f // world units the bounds grow by, the culled set is drawn a frame or two late
+#define GPU_CULL_MIN_SIZE 0.002f // boxes whose radius over distance is smaller are not drawn
+#define PVS_FILE "pvs.bin" // potentially visible sets written by --bake-pvs, V toggles using them
+#define PVS_CELL_SIZE 2.0f // edge of a baked cell, the cells cover the world bounds
+#define PVS_SAMPLES_PER_CELL 16
+#define PVS_RAYS_PER_SAMPLE 256
+#define PVS_MAX_DISTANCE FAR_CLIP // nothing beyond the far plane is drawn anyway
+#define DEPTH_PREPASS true // Z toggles; opaque depth first, then lit shading only where the depth is equal
+#define STATIC_LAYER_CACHE true // C toggles; boxes, lamp and ground are redrawn only when they change on screen
+
+#define QUALITY_BUDGET_MS 16.0 // CPU or GPU time per frame the quality governor keeps below
+
+#define LOG_LEVEL LOG_LEVEL_INFO // LOG_LEVEL_DEBUG traces every rain particle
+
+#define FRAME_ARENA_SIZE (256 * 1024) // bytes of transient data per thread and frame, grows if exceeded
+#ifndef NDEBUG
+#define FRAME_ARENA_COUNT_HEAP // debug builds report frames that still allocate from the heap, counted by heap_check.cpp
+#endif
+#define HEAP_CHECK_WARMUP_FRAMES 300 // frames each thread runs before its buffers count as grown
+
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -30,11 +83,34 @@
 #include "helper/shader.h"
 #include "helper/camera.h"
 #include "helper/filesystem.h"
+#include "helper/particle_pool.h"
+#include "helper/scene_store.h"
+#include "helper/occlusion_heightmap.h"
+#include "helper/radix_sort.h"
+#include "helper/smoke_fluid.h"
+#include "helper/simulation_clock.h"
+#include "helper/job_system.h"
+#include "helper/triple_buffer.h"
+#include "helper/draw_list.h"
+#include "helper/logger.h"
+#include "helper/frame_pacer.h"
+#include "helper/frame_arena.h"
+#include "helper/resolution_scaler.h"
+#include "helper/quality_governor.h"
+#include "helper/frustum_culler.h"
+#include "helper/bvh.h"
+#include "helper/software_occlusion.h"
+#include "helper/pvs.h"
 #include "stb_image.h"
 
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
 #include <cstdlib>
 #include <ctime>
 using namespace std;
@@ -45,23 +121,93 @@ typedef struct{
 
 typedef struct{
     float x, y, z;
+    float prev_y; // y one cycle earlier, for interpolation
     float speed; // on y axis
 } rain;
 
 typedef struct{
     float x, y, z;
+    float prev_x, prev_y, prev_z; // position one cycle earlier, for interpolation
     float halftime, decaytime; // on 0-1s move on hor and ver on 1-2s move on ver
     float x_speed, y_speed, z_speed; // on y axis
 } smoke;
 
+// draw packet passes in the order they are replayed, smoke is blended so it goes last
+enum DrawPass {
+    PASS_BOXES,
+    PASS_LAMP,
+    PASS_GROUND,
+    PASS_RAIN, // first dynamic pass, the passes before it form the static layer
+    PASS_SMOKE,
+    PASS_COUNT
+};
+
+// how boxes hidden behind other boxes are skipped
+enum OcclusionMode {
+    OCCLUSION_OFF,
+    OCCLUSION_SOFTWARE, // the biggest nearby boxes are rasterized on the CPU, the rest tested against them
+    OCCLUSION_HARDWARE, // the bounds of groups of boxes are drawn with occlusion queries, read a frame later
+    OCCLUSION_MODES
+};
+const char *OCCLUSION_MODE_NAMES[] = { "off", "software", "hardware" };
+
+// world bounds of a group of boxes that is tested with one occlusion query
+typedef struct{
+    glm::vec3 Min, Max;
+} OcclusionGroup;
+
+// everything the render thread draws in one frame, filled by the main thread; the vectors keep
+// their capacity as the snapshot slots are recycled
+typedef struct{
+    int Width, Height; // framebuffer
+    int SwapInterval;
+    glm::mat4 View, Projection, ViewProjection;
+    Frustum ViewFrustum;
+    glm::vec3 ViewPos, CameraRight, CameraUp;
+    glm::vec3 LightPos;
+    unsigned long SceneVersion;
+    bool CacheStaticLayer;
+    OcclusionMode Occlusion;
+    unsigned int GroupBuilds; // group numbers are only comparable between snapshots of one build
+    vector<OcclusionGroup> Groups; // empty unless hardware occlusion is on
+    bool GpuCulling; // the boxes come as instances instead of packets
+    bool DepthPrepass;
+    unsigned long BoxInstancesVersion = ~0ul; // scene version of BoxInstances
+    vector<glm::vec4> BoxInstances; // position and texture, scale; every box, refilled when the scene changes
+    DrawListSet Draws;
+    vector<glm::vec4> Rain; // centre, fall speed
+    vector<glm::vec4> Smoke; // centre, size; back to front
+} FrameSnapshot;
+
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods);
 void processInput(GLFWwindow *window);
+void spawnSmoke(smoke &particle, glm::vec3 origin);
+float randomFloat(unsigned int &state, float min, float max);
+void renderThread(GLFWwindow *window, TripleBuffer<FrameSnapshot> &frames, JobSystem &jobs);
 
 // settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
+int framebufferWidth = SCR_WIDTH;
+int framebufferHeight = SCR_HEIGHT;
+
+// cleared to stop the render thread, or by it when it could not start
+std::atomic<bool> rendering(true);
+
+// GPU frame time the resolution scale could no longer absorb, written by the render thread
+std::atomic<float> gpuOverloadMs(0.0f);
+
+// boxes the last GPU culling pass kept, written by the render thread
+std::atomic<unsigned int> gpuCulledBoxes(0);
+
+// lit fragments per pixel of the last measured static layer, and whether it had a depth prepass;
+// written by the render thread
+std::atomic<float> opaqueOverdraw(0.0f);
+std::atomic<bool> opaqueOverdrawPrepass(false);
 
 // camera
 Camera camera(glm::vec3(0.0f, 0.0f, 3.0f));
@@ -79,11 +225,43 @@ glm::vec3 lightPos(5.0f, 5.0f, 20.0f);
 //glm::vec3 lightPos(-5.0f, -1.3f, -15.0f);
 
 
+// smoke simulation, F toggles the fluid solver
+bool smokeFluidEnabled = false;
+
+// frame pacing, P pauses the simulation so the idle mode can stop rendering
+FramePacer framePacer(FRAME_PACING, TARGET_FPS);
+bool simulationPaused = false;
+
+// static layer, C switches between caching it and redrawing it every frame
+bool staticLayerCache = STATIC_LAYER_CACHE;
+
+// occlusion culling, O cycles through the modes
+OcclusionMode occlusionMode = OCCLUSION_CULLING;
+
+// depth prepass, Z toggles it for the boxes, lamp and ground
+bool depthPrepass = DEPTH_PREPASS;
+
+// GPU culling, G switches the boxes between CPU culled packets and GPU culled instances
+bool gpuCulling = GPU_CULLING;
+
+// baked visibility, V switches between the camera cell's set and culling
+bool pvsEnabled = true;
+
+// picking, a left click picks the box in the middle of the view
+bool pickRequested = false;
+
 // ground
 glm::vec3 groundPos(5.0f, -1.3f, 5.0f);
 
-int main()
+int main(int argc, char *argv[])
 {
+    // --bake-pvs writes the potentially visible sets of the scene and exits
+    bool bakePvs = false;
+    for (int a = 1; a < argc; ++a) {
+        if (string(argv[a]) == "--bake-pvs")
+            bakePvs = true;
+    }
+
     srand (static_cast <unsigned> (time(0)));
     // glfw: initialize and configure
     // ------------------------------
@@ -91,6 +269,7 @@ int main()
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, bakePvs ? GLFW_FALSE : GLFW_TRUE);
 
 #ifdef __APPLE__
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // uncomment this statement to fix compilation on OS X
@@ -101,93 +280,28 @@ int main()
     GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "Car Showcase", NULL, NULL);
     if (window == NULL)
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
+        LOG_ERROR("Failed to create GLFW window");
         glfwTerminate();
         return -1;
     }
-    glfwMakeContextCurrent(window);
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
     glfwSetCursorPosCallback(window, mouse_callback);
     glfwSetScrollCallback(window, scroll_callback);
+    glfwSetKeyCallback(window, key_callback);
+    glfwSetMouseButtonCallback(window, mouse_button_callback);
 
     // tell GLFW to capture our mouse
     glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
-    // glad: load all OpenGL function pointers
-    // ---------------------------------------
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
-    {
-        std::cout << "Failed to initialize GLAD" << std::endl;
-        return -1;
-    }
-
-    // configure global opengl state
-    // -----------------------------
-    glEnable(GL_DEPTH_TEST);
-
-    // build and compile our shader zprogram
-    // ------------------------------------
-    Shader lightingShader("lighting.vs", "lighting.fs");
-    Shader lampShader("lamp.vs", "lamp.fs");
-    Shader groundShader("ground.vs", "ground.fs");
-    Shader particleShader("particle.vs", "particle.fs");
-    Shader waterShader("water.vs", "water.fs");
+    // the render thread owns the GL context, the viewport follows this size
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+    camera.SetViewport(framebufferWidth, framebufferHeight);
 
-    // set up vertex data (and buffer(s)) and configure vertex attributes
-    // ------------------------------------------------------------------
-    float vertices[] = {
-            -0.5f, -0.5f, -1.0f,  0.0f, 0.0f, 0.0f,  0.0f, -1.0f,
-            0.5f, -0.5f, -1.0f,  1.0f, 0.0f, 0.0f,  0.0f, -1.0f,
-            0.5f,  0.5f, -1.0f,  1.0f, 1.0f, 0.0f,  0.0f, -1.0f,
-            0.5f,  0.5f, -1.0f,  1.0f, 1.0f, 0.0f,  0.0f, -1.0f,
-            -0.5f,  0.5f, -1.0f,  0.0f, 1.0f, 0.0f,  0.0f, -1.0f,
-            -0.5f, -0.5f, -1.0f,  0.0f, 0.0f, 0.0f,  0.0f, -1.0f,
-
-            -0.5f, -0.5f,  1.0f,  0.0f, 0.0f, 0.0f,  0.0f,  1.0f,
-            0.5f, -0.5f,  1.0f,  1.0f, 0.0f, 0.0f,  0.0f,  1.0f,
-            0.5f,  0.5f,  1.0f,  1.0f, 1.0f, 0.0f,  0.0f,  1.0f,
-            0.5f,  0.5f,  1.0f,  1.0f, 1.0f, 0.0f,  0.0f,  1.0f,
-            -0.5f,  0.5f,  1.0f,  0.0f, 1.0f, 0.0f,  0.0f,  1.0f,
-            -0.5f, -0.5f,  1.0f,  0.0f, 0.0f, 0.0f,  0.0f,  1.0f,
-
-            -0.5f,  0.5f,  1.0f,  1.0f, 0.0f, -1.0f,  0.0f,  0.0f,
-            -0.5f,  0.5f, -1.0f,  1.0f, 1.0f, -1.0f,  0.0f,  0.0f,
-            -0.5f, -0.5f, -1.0f,  0.0f, 1.0f, -1.0f,  0.0f,  0.0f,
-            -0.5f, -0.5f, -1.0f,  0.0f, 1.0f, -1.0f,  0.0f,  0.0f,
-            -0.5f, -0.5f,  1.0f,  0.0f, 0.0f, -1.0f,  0.0f,  0.0f,
-            -0.5f,  0.5f,  1.0f,  1.0f, 0.0f, -1.0f,  0.0f,  0.0f,
-
-            0.5f,  0.5f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f,  0.0f,
-            0.5f,  0.5f, -1.0f,  1.0f, 1.0f, 1.0f,  0.0f,  0.0f,
-            0.5f, -0.5f, -1.0f,  0.0f, 1.0f, 1.0f,  0.0f,  0.0f,
-            0.5f, -0.5f, -1.0f,  0.0f, 1.0f, 1.0f,  0.0f,  0.0f,
-            0.5f, -0.5f,  1.0f,  0.0f, 0.0f, 1.0f,  0.0f,  0.0f,
-            0.5f,  0.5f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f,  0.0f,
-
-            -0.5f, -0.5f, -1.0f,  0.0f, 1.0f, 0.0f, -1.0f,  0.0f,
-            0.5f, -0.5f, -1.0f,  1.0f, 1.0f, 0.0f, -1.0f,  0.0f,
-            0.5f, -0.5f,  1.0f,  1.0f, 0.0f, 0.0f, -1.0f,  0.0f,
-            0.5f, -0.5f,  1.0f,  1.0f, 0.0f, 0.0f, -1.0f,  0.0f,
-            -0.5f, -0.5f,  1.0f,  0.0f, 0.0f, 0.0f, -1.0f,  0.0f,
-            -0.5f, -0.5f, -1.0f,  0.0f, 1.0f, 0.0f, -1.0f,  0.0f,
-
-            -0.5f,  0.5f, -1.0f,  0.0f, 1.0f, 0.0f,  1.0f,  0.0f,
-            0.5f,  0.5f, -1.0f,  1.0f, 1.0f, 0.0f,  1.0f,  0.0f,
-            0.5f,  0.5f,  1.0f,  1.0f, 0.0f, 0.0f,  1.0f,  0.0f,
-            0.5f,  0.5f,  1.0f,  1.0f, 0.0f, 0.0f,  1.0f,  0.0f,
-            -0.5f,  0.5f,  1.0f,  0.0f, 0.0f, 0.0f,  1.0f,  0.0f,
-            -0.5f,  0.5f, -1.0f,  0.0f, 1.0f,  0.0f,  1.0f,  0.0f
-    };
-
-    float ground[] = { // consist of two triangle
-            10.0f, 10.0f, 10.0f,
-            -10.0f, 10.0f, 10.0f,
-            -10.0f, -10.0f, 10.0f,
+    // worker threads for simulation, sorting and asset decoding; this thread is worker 0
+    JobSystem jobs;
 
-            -10.0f, 10.0f, 10.0f,
-            -10.0f, -10.0f, 10.0f,
-            10.0f, -10.0f, 10.0f
-    };
+    // transient per-frame data, one arena per thread, all reset at the start of a frame
+    FrameArenaSet frameArenas(FRAME_ARENA_SIZE);
 
     // --------------------------------------------------------------------------------------------------
     // READING POSITION DATA
@@ -236,52 +350,73 @@ int main()
 
         imageFile.close();
     }
-    else cout << "Unable to open file";
+    else LOG_ERROR("Unable to open file");
 
     if (count == 10000) {
-        cout << "Error reading file" << endl;
+        LOG_ERROR("Error reading file");
         return 0;
     }
 
-    // world space positions of our cubes
-    glm::vec3 cubePositions[position.size()];
-
-    int iterate = 0;
-    for (std::vector<glm::vec3>::const_iterator is = position.begin(); is != position.end(); ++is) {
-        cubePositions[iterate] = *is;
-        iterate++;
+    // every box of the car, kept in one store so derived structures can track edits
+    SceneStore scene;
+    for (unsigned int i = 0; i < position.size(); i++) {
+        SceneBox box;
+        box.Scale = scaler[i];
+        box.Position = position[i];
+        box.Color = color[i];
+        box.Texture = objectTexture[i];
+        scene.Add(box);
     }
 
-    // world space scale of our cubes
-    glm::vec3 cubeScaler[scaler.size()];
-
-    iterate = 0;
-    for (std::vector<glm::vec3>::const_iterator is = scaler.begin(); is != scaler.end(); ++is) {
-        cubeScaler[iterate] = *is;
-        iterate++;
+    // top-down heightmap of the boxes, rain dies when it falls below it
+    OcclusionHeightmap rainOcclusion(WORLD_LEFT, WORLD_FRONT, WORLD_RIGHT, WORLD_BACK, OCCLUSION_CELL_SIZE, WORLD_BOTTOM);
+    rainOcclusion.Rebuild(scene);
+
+    // box bounds for frustum culling, only the boxes in view are recorded for drawing
+    FrustumCuller boxCuller;
+    boxCuller.Rebuild(scene);
+    vector<unsigned int> visibleBoxes;
+    unsigned int boxesInFrustum = 0;
+
+    // boxes in the frustum are then tested against a small depth buffer of the nearest big boxes
+    SoftwareOcclusion boxOcclusion(OCCLUSION_BUFFER_WIDTH, OCCLUSION_BUFFER_HEIGHT);
+
+    // hierarchy over the boxes for ray and overlap queries; its subtrees are the hardware
+    // occlusion groups
+    Bvh sceneBvh;
+    sceneBvh.Rebuild(scene);
+    vector<unsigned int> occlusionGroups;
+    vector<int> boxGroup;
+    unsigned int groupedBuild = 0;
+
+    LOG_INFO("loaded {} boxes", scene.Size());
+
+    // potentially visible sets: baked on request, otherwise loaded when there is a bake of
+    // these boxes; the camera's cell then is the draw set while the scene stays unedited
+    PotentiallyVisibleSet pvs;
+    if (bakePvs) {
+        double bakeStart = glfwGetTime();
+        pvs.Bake(scene, sceneBvh, jobs, glm::vec3(WORLD_LEFT, WORLD_BOTTOM, WORLD_FRONT), glm::vec3(WORLD_RIGHT, WORLD_TOP, WORLD_BACK),
+                 PVS_CELL_SIZE, PVS_SAMPLES_PER_CELL, PVS_RAYS_PER_SAMPLE, PVS_MAX_DISTANCE);
+        if (pvs.Save(PVS_FILE)) {
+            LOG_INFO("baked {} cells into {}, {} bytes, {} s", pvs.CellCount(), PVS_FILE, pvs.Bytes(), glfwGetTime() - bakeStart);
+        }
+        else {
+            LOG_ERROR("Unable to write {}", PVS_FILE);
+        }
+        glfwTerminate();
+        return 0;
     }
-
-    // world color of our cubes
-    glm::vec3 cubeColor[color.size()];
-
-    iterate = 0;
-    for (std::vector<glm::vec3>::const_iterator is = color.begin(); is != color.end(); ++is) {
-        cubeColor[iterate] = *is;
-        iterate++;
+    if (pvs.Load(PVS_FILE, scene)) {
+        LOG_INFO("loaded potentially visible sets of {} cells", pvs.CellCount());
     }
-
-    // world color of our cubes
-    int cubeTexture[objectTexture.size()];
-
-    iterate = 0;
-    for (std::vector<int>::const_iterator is = objectTexture.begin(); is != objectTexture.end(); ++is) {
-        cubeTexture[iterate] = *is;
-        iterate++;
+    else {
+        LOG_INFO("no potentially visible sets of this scene in {}, run with --bake-pvs to bake them", PVS_FILE);
     }
-
-    cout << position.size() << endl;
-    cout << scaler.size() << endl;
-    cout << color.size() << endl;
+    unsigned long pvsSceneVersion = scene.Version();
+    int pvsCell = -1;
+    vector<unsigned int> pvsBoxes;
+    bool pvsUsed = false;
 
     // --------------------------------------------------------------------------------------------------
 
@@ -292,24 +427,489 @@ int main()
         rainParticle[i].x = static_cast<float>(WORLD_LEFT + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (WORLD_RIGHT - WORLD_LEFT))));
         rainParticle[i].z = static_cast<float>(WORLD_FRONT + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (WORLD_BACK - WORLD_FRONT))));
         rainParticle[i].y = WORLD_TOP;
+        rainParticle[i].prev_y = rainParticle[i].y;
         rainParticle[i].speed = static_cast<float>(PARTICLE_MIN_SPEED + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (PARTICLE_MAX_SPEED - PARTICLE_MIN_SPEED))));
-        cout << rainParticle[i].x << " " << rainParticle[i].y << " " << rainParticle[i].z << " " << rainParticle[i].speed << endl;
+        LOG_DEBUG("particle {} : {} {} {} {}", i, rainParticle[i].x, rainParticle[i].y, rainParticle[i].z, rainParticle[i].speed);
     }
 
     // generating smoke
-    smoke smokeParticle[NUMBER_OF_SMOKE_PARTICLE];
-
-    for (int j = 0; j < NUMBER_OF_SMOKE_PARTICLE; ++j) {
-        smokeParticle[j].x = START_X;
-        smokeParticle[j].y = START_Y;
-        smokeParticle[j].z = START_Z;
-        smokeParticle[j].decaytime = rand()%(SMOKE_MAX_LIFETIME + 1);
-        smokeParticle[j].halftime = smokeParticle[j].decaytime / 2;
-        smokeParticle[j].x_speed = static_cast<float>(-PARTICLE_SPEED + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (PARTICLE_SPEED * 2))));
-        smokeParticle[j].y_speed = static_cast<float>(PARTICLE_MIN_SPEED + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (PARTICLE_MAX_SPEED - PARTICLE_MIN_SPEED))));
-        smokeParticle[j].z_speed = static_cast<float>(PARTICLE_MIN_SPEED + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (PARTICLE_MAX_SPEED - PARTICLE_MIN_SPEED))));
+    // every source draws from one shared pool, particles are spawned by the emitters each cycle
+    ParticlePool<smoke> smokeParticle(NUMBER_OF_SMOKE_PARTICLE);
+    vector<ParticleEmitter> smokeEmitter;
+    smokeEmitter.push_back(ParticleEmitter(glm::vec3(START_X, START_Y, START_Z), EXHAUST_EMIT_RATE)); // knalpot
+    smokeEmitter.push_back(ParticleEmitter(glm::vec3(-3.0f, 4.0f, -10.0f), CHIMNEY_EMIT_RATE)); // chimney
+
+    // optional fluid grid around the exhaust, particles inside it follow the flow
+    SmokeFluid smokeFluid(jobs, smokeEmitter[0].Position, SMOKE_FLUID_SIZE, SMOKE_FLUID_MIN_RESOLUTION, SMOKE_FLUID_MAX_RESOLUTION, SMOKE_FLUID_BUDGET_MS);
+
+    // back-to-front order of the smoke, reused every frame so the sort sees nearly sorted input
+    vector<unsigned int> smokeOrder;
+    RadixSorter smokeSorter(&jobs);
+
+    // simulation advances in fixed cycles, independent of the frame rate
+    SimulationClock simulationClock(SIMULATION_STEP, MAX_CYCLES_PER_FRAME);
+
+    // frames are handed to the render thread as snapshots, it draws one while this thread
+    // simulates the next
+    TripleBuffer<FrameSnapshot> frames;
+    std::thread renderer(renderThread, window, std::ref(frames), std::ref(jobs));
+
+    // quality governor, knobs in the order they are given up when frames run over budget
+    QualityGovernor quality(QUALITY_BUDGET_MS);
+    unsigned int fluidRateKnob = quality.AddKnob("smoke fluid rate", 3); // solved every 1, 2 or 4 cycles
+    unsigned int fluidKnob = quality.AddKnob("smoke fluid", 2); // off at level 1
+    unsigned int rainKnob = quality.AddKnob("rain count", 4); // 100, 75, 50 or 25 percent of the drops
+    unsigned int smokeKnob = quality.AddKnob("smoke count", 3); // 100, 67 or 33 percent of the emission
+    vector<float> smokeEmitRate;
+    for (unsigned int e = 0; e < smokeEmitter.size(); ++e) {
+        smokeEmitRate.push_back(smokeEmitter[e].Rate);
+    }
+    unsigned int activeRain = NUMBER_OF_RAIN_PARTICLE;
+
+    float lastStatsReport = glfwGetTime();
+    unsigned long long simulationFrames = 0;
+
+    // simulation loop
+    // ---------------
+    while (!glfwWindowShouldClose(window) && rendering)
+    {
+        // per-frame time logic
+        // --------------------
+        framePacer.BeginFrame();
+        frameArenas.Reset();
+        double frameStart = glfwGetTime();
+        float currentFrame = glfwGetTime();
+        deltaTime = currentFrame - lastFrame;
+        lastFrame = currentFrame;
+
+        if (currentFrame - lastStatsReport > FRAME_STATS_INTERVAL) {
+            const FrameStats &stats = framePacer.Stats();
+            LOG_INFO("{} pacing: {} frames, avg {} ms, min {} ms, max {} ms, 99% {} ms", framePacer.ModeName(), stats.Count(), stats.Average(), stats.Min(), stats.Max(), stats.Percentile(0.99));
+            if (gpuCulling) {
+                LOG_INFO("{} of {} boxes kept by gpu culling", gpuCulledBoxes.load(), scene.Size());
+            }
+            else if (pvsUsed) {
+                LOG_INFO("{} of {} boxes potentially visible from cell {}", visibleBoxes.size(), scene.Size(), pvsCell);
+            }
+            else {
+                LOG_INFO("{} of {} boxes in the frustum, {} not occluded", boxesInFrustum, scene.Size(), visibleBoxes.size());
+            }
+            LOG_INFO("opaque shading {} fragments per pixel, depth prepass {}", opaqueOverdraw.load(), opaqueOverdrawPrepass.load() ? "on" : "off");
+            lastStatsReport = currentFrame;
+        }
+#ifdef FRAME_ARENA_COUNT_HEAP
+        // from here to the hand-off of the snapshot this thread should not touch the heap
+        BeginHeapCheck();
+#endif
+
+        // input
+        // -----
+        processInput(window);
+
+        // the cursor is captured, so picking casts a ray straight through the centre of the view
+        sceneBvh.Update(scene);
+        if (pickRequested) {
+            pickRequested = false;
+            Ray ray;
+            ray.Origin = camera.Position;
+            ray.Direction = camera.Front;
+            ray.MaxDistance = FAR_CLIP;
+            RayHit hit = sceneBvh.Intersect(ray);
+            if (hit.Box >= 0) {
+                LOG_INFO("picked box {} at distance {}", hit.Box, hit.Distance);
+            }
+            else {
+                LOG_INFO("picked nothing");
+            }
+        }
+
+        // simulation
+        // ----------
+        // the key callback flips the flag, the clock follows it here; a paused clock is not
+        // advanced, so the interpolation between the last two states holds still
+        if (simulationPaused != simulationClock.Paused()) {
+            if (simulationPaused) {
+                simulationClock.Pause();
+            }
+            else {
+                simulationClock.Resume(glfwGetTime());
+            }
+        }
+        unsigned int cycles = simulationPaused ? 0 : simulationClock.Advance(glfwGetTime());
+        bool fluidActive = smokeFluidEnabled && quality.Level(fluidKnob) == 0;
+        unsigned int fluidInterval = 1u << quality.Level(fluidRateKnob);
+        for (unsigned int cycle = 0; cycle < cycles; ++cycle) {
+            // update rain, drops respawn once they land on a roof or reach the bottom
+            rainOcclusion.Update(scene);
+            unsigned long long step = simulationClock.Steps() - cycles + cycle + 1; // this cycle's step number
+            jobs.ParallelFor(0, activeRain, RAIN_GRAIN, [&](unsigned int begin, unsigned int end) {
+                // rand() is not safe across threads, every range gets its own generator
+                unsigned int seed = ((unsigned int)(step * 2654435761u) ^ (begin * 40503u)) | 1u;
+                for (unsigned int i = begin; i < end; ++i) {
+                    rainParticle[i].prev_y = rainParticle[i].y;
+                    rainParticle[i].y -= rainParticle[i].speed;
+                    if (rainParticle[i].y < rainOcclusion.Height(rainParticle[i].x, rainParticle[i].z)) {
+                        rainParticle[i].x = randomFloat(seed, WORLD_LEFT, WORLD_RIGHT);
+                        rainParticle[i].z = randomFloat(seed, WORLD_FRONT, WORLD_BACK);
+                        rainParticle[i].y = WORLD_TOP;
+                        rainParticle[i].prev_y = rainParticle[i].y;
+                        rainParticle[i].speed = randomFloat(seed, PARTICLE_MIN_SPEED, PARTICLE_MAX_SPEED);
+                        LOG_DEBUG("regenerate particle {} : {} {} {} {}", i, rainParticle[i].x, rainParticle[i].y, rainParticle[i].z, rainParticle[i].speed);
+                    }
+                }
+            });
+
+            // update smoke
+            for (unsigned int e = 0; e < smokeEmitter.size(); ++e) {
+                smokeEmitter[e].Emit(smokeParticle, spawnSmoke);
+            }
+            if (fluidActive && step % fluidInterval == 0) {
+                // a coarser solver rate takes proportionally longer steps
+                smokeFluid.Step(LIFESPAN_PER_CYCLE * fluidInterval);
+            }
+            jobs.ParallelFor(0, smokeParticle.Size(), SMOKE_GRAIN, [&](unsigned int begin, unsigned int end) {
+                for (unsigned int j = begin; j < end; ++j) {
+                    smokeParticle[j].decaytime -= LIFESPAN_PER_CYCLE;
+                    if (smokeParticle[j].decaytime < 0) {
+                        continue;
+                    }
+
+                    glm::vec3 puff(smokeParticle[j].x, smokeParticle[j].y, smokeParticle[j].z);
+                    smokeParticle[j].prev_x = puff.x;
+                    smokeParticle[j].prev_y = puff.y;
+                    smokeParticle[j].prev_z = puff.z;
+                    if (fluidActive && smokeFluid.Contains(puff)) {
+                        glm::vec3 flow = smokeFluid.Sample(puff) * (float)LIFESPAN_PER_CYCLE;
+                        smokeParticle[j].x += flow.x;
+                        smokeParticle[j].y += flow.y;
+                        smokeParticle[j].z += flow.z;
+                    }
+                    else if (smokeParticle[j].decaytime < smokeParticle[j].halftime) {
+                        smokeParticle[j].x += smokeParticle[j].x_speed;
+                        smokeParticle[j].y += smokeParticle[j].y_speed;
+                        smokeParticle[j].z += smokeParticle[j].z_speed;
+                    }
+                    else {
+                        smokeParticle[j].x += smokeParticle[j].x_speed;
+                        smokeParticle[j].z += smokeParticle[j].z_speed;
+                    }
+                }
+            });
+            // compacting the pool reorders it, so dead puffs are removed afterwards on this thread
+            for (unsigned int j = 0; j < smokeParticle.Size(); ) {
+                if (smokeParticle[j].decaytime < 0) {
+                    // the last live particle moves into slot j, so visit j again
+                    smokeParticle.Kill(j);
+                    continue;
+                }
+                ++j;
+            }
+        }
+        // particles are drawn in between the last two cycles
+        float alpha = simulationClock.Alpha();
+        // snapshot
+        // --------
+        // everything the render thread needs is copied out, it never reads simulation state
+        FrameSnapshot &frame = frames.Back();
+        frame.Width = framebufferWidth;
+        frame.Height = framebufferHeight;
+        frame.SwapInterval = framePacer.SwapInterval();
+        frame.ViewPos = camera.Position;
+        frame.CameraRight = camera.Right;
+        frame.CameraUp = camera.Up;
+        frame.LightPos = lightPos;
+        frame.SceneVersion = scene.Version();
+        frame.CacheStaticLayer = staticLayerCache;
+
+        // view/projection transformations, cached by the camera until it moves
+        frame.Projection = camera.GetProjectionMatrix();
+        frame.View = camera.GetViewMatrix();
+        frame.ViewProjection = camera.GetViewProjectionMatrix();
+        frame.ViewFrustum = camera.GetFrustum();
+
+        // rain
+        frame.Rain.resize(activeRain);
+        jobs.ParallelFor(0, activeRain, RAIN_GRAIN, [&](unsigned int begin, unsigned int end) {
+            for (unsigned int i = begin; i < end; ++i) {
+                float y = glm::mix(rainParticle[i].prev_y, rainParticle[i].y, alpha);
+                frame.Rain[i] = glm::vec4(rainParticle[i].x, y, rainParticle[i].z, rainParticle[i].speed);
+            }
+        });
+
+        // smoke, sorted back to front; positions and depths only live for this frame
+        FrameArena &arena = frameArenas.Local(jobs);
+        FrameVector<glm::vec3> smokePosition(smokeParticle.Size(), glm::vec3(0.0f), ArenaAllocator<glm::vec3>(arena));
+        FrameVector<float> smokeDepth(smokeParticle.Size(), 0.0f, ArenaAllocator<float>(arena));
+        jobs.ParallelFor(0, smokeParticle.Size(), SMOKE_GRAIN, [&](unsigned int begin, unsigned int end) {
+            for (unsigned int j = begin; j < end; ++j) {
+                const smoke &puff = smokeParticle[j];
+                smokePosition[j] = glm::mix(glm::vec3(puff.prev_x, puff.prev_y, puff.prev_z), glm::vec3(puff.x, puff.y, puff.z), alpha);
+                // view space z is negative in front of the camera, ascending z is back to front
+                smokeDepth[j] = (frame.View * glm::vec4(smokePosition[j], 1.0f)).z;
+            }
+        });
+
+        // last frame's order is kept, so a still camera only pays for the few particles that moved
+        RadixSorter::KeepPermutation(smokeOrder, smokeParticle.Size());
+        smokeSorter.Sort(smokeDepth.data(), smokeOrder);
+        frame.Smoke.resize(smokeOrder.size());
+        for (unsigned int j = 0; j < smokeOrder.size(); ++j) {
+            frame.Smoke[j] = glm::vec4(smokePosition[smokeOrder[j]], SMOKE_SIZE);
+        }
+
+        // draw packets
+        // ------------
+        // recorded by the workers into their own lists, the render thread merges and replays them
+        frame.Draws.Clear();
+        frame.GpuCulling = gpuCulling;
+        frame.DepthPrepass = depthPrepass;
+        int cell = (pvsEnabled && scene.Version() == pvsSceneVersion) ? pvs.Cell(camera.Position) : -1;
+        pvsUsed = !gpuCulling && cell >= 0;
+        if (gpuCulling) {
+            // the render thread culls every box itself, it only needs them again after an edit
+            visibleBoxes.clear();
+            boxesInFrustum = 0;
+            if (frame.BoxInstancesVersion != scene.Version()) {
+                frame.BoxInstances.resize(2 * scene.Size());
+                jobs.ParallelFor(0, scene.Size(), DRAW_GRAIN, [&](unsigned int begin, unsigned int end) {
+                    for (unsigned int i = begin; i < end; ++i) {
+                        // boxes without a texture of their own keep texture1
+                        int texture = (scene[i].Texture >= 1 && scene[i].Texture <= 3) ? scene[i].Texture : 1;
+                        frame.BoxInstances[2 * i] = glm::vec4(scene[i].Position, (float)texture);
+                        frame.BoxInstances[2 * i + 1] = glm::vec4(scene[i].Scale, 0.0f);
+                    }
+                });
+                frame.BoxInstancesVersion = scene.Version();
+            }
+        }
+        else if (pvsUsed) {
+            // the baked set stands in for frustum and occlusion culling, decoded on entering a cell
+            if (cell != pvsCell) {
+                pvs.Visible(cell, pvsBoxes);
+                pvsCell = cell;
+            }
+            visibleBoxes.assign(pvsBoxes.begin(), pvsBoxes.end());
+            boxesInFrustum = visibleBoxes.size();
+        }
+        else {
+            boxCuller.Update(scene);
+            boxCuller.Cull(frame.ViewFrustum, jobs, visibleBoxes);
+            boxesInFrustum = visibleBoxes.size();
+        }
+        if (occlusionMode == OCCLUSION_SOFTWARE && !gpuCulling && !pvsUsed) {
+            boxOcclusion.Render(frame.ViewProjection, frame.ViewPos, scene, visibleBoxes, jobs);
+            boxOcclusion.Cull(scene, visibleBoxes, jobs);
+        }
+        frame.Groups.clear();
+        if (occlusionMode == OCCLUSION_HARDWARE && !gpuCulling) {
+            if (groupedBuild != sceneBvh.Builds()) {
+                sceneBvh.Cut(OCCLUSION_GROUP_SIZE, occlusionGroups, boxGroup);
+                groupedBuild = sceneBvh.Builds();
+            }
+            frame.Groups.resize(occlusionGroups.size());
+            for (unsigned int g = 0; g < occlusionGroups.size(); ++g) {
+                frame.Groups[g].Min = sceneBvh.Nodes()[occlusionGroups[g]].Min;
+                frame.Groups[g].Max = sceneBvh.Nodes()[occlusionGroups[g]].Max;
+            }
+        }
+        frame.Occlusion = occlusionMode;
+        frame.GroupBuilds = groupedBuild;
+        jobs.ParallelFor(0, visibleBoxes.size(), DRAW_GRAIN, [&](unsigned int begin, unsigned int end) {
+            vector<DrawPacket> &packets = frame.Draws.Local(jobs);
+            for (unsigned int v = begin; v < end; v++) {
+                unsigned int i = visibleBoxes[v];
+                // calculate the model matrix for each object
+                glm::mat4 model = glm::mat4(1.0f); // make sure to initialize matrix to identity matrix first
+                model = glm::translate(model, scene[i].Position);
+                float angle = 0.0f * i;
+                model = glm::scale(model, scene[i].Scale);
+                model = glm::rotate(model, glm::radians(angle), glm::vec3(1.0f, 0.3f, 0.5f));
+                // the inverse transpose of a scale times a rotation is the inverse scale times the
+                // rotation, so the normal matrix needs no general inverse
+                glm::mat3 normal = glm::mat3(glm::rotate(glm::mat4(1.0f), glm::radians(angle), glm::vec3(1.0f, 0.3f, 0.5f)));
+                normal = glm::mat3(glm::scale(glm::mat4(1.0f), 1.0f / scene[i].Scale)) * normal;
+
+                DrawPacket packet;
+                packet.Pass = PASS_BOXES;
+                packet.Texture = scene[i].Texture;
+                packet.Group = frame.Groups.empty() ? -1 : boxGroup[i];
+                packet.Instances = 0;
+                packet.Model = model;
+                packet.Normal = normal;
+                packet.Color = scene[i].Color;
+                packet.Key = MakeDrawKey(PASS_BOXES, packet.Texture, -(frame.View * glm::vec4(scene[i].Position, 1.0f)).z);
+                packets.push_back(packet);
+            }
+        });
+
+        vector<DrawPacket> &packets = frame.Draws.Local(jobs);
+        DrawPacket packet;
+        packet.Texture = 0;
+        packet.Group = -1;
+        packet.Instances = 0;
+        packet.Color = glm::vec3(1.0f);
+        packet.Normal = glm::mat3(1.0f); // lamp and ground are unlit
+
+        // lamp, a smaller cube
+        packet.Pass = PASS_LAMP;
+        packet.Model = glm::scale(glm::translate(glm::mat4(1.0f), lightPos), glm::vec3(0.2f));
+        packet.Key = MakeDrawKey(packet.Pass, 0, 0.0f);
+        packets.push_back(packet);
+
+        // ground
+        packet.Pass = PASS_GROUND;
+        packet.Model = glm::scale(glm::translate(glm::mat4(1.0f), groundPos), glm::vec3(20.0f, 0.1f, 20.0f));
+        packet.Key = MakeDrawKey(packet.Pass, 0, 0.0f);
+        packets.push_back(packet);
+
+        // particles, one instanced draw of 4 vertices per system
+        packet.Model = glm::mat4(1.0f);
+        packet.Pass = PASS_RAIN;
+        packet.Instances = frame.Rain.size();
+        packet.Key = MakeDrawKey(packet.Pass, 0, 0.0f);
+        packets.push_back(packet);
+        packet.Pass = PASS_SMOKE;
+        packet.Instances = frame.Smoke.size();
+        packet.Key = MakeDrawKey(packet.Pass, 0, 0.0f);
+        if (packet.Instances > 0) {
+            packets.push_back(packet);
+        }
+        frames.Publish();
+
+        // trade quality for time when the frame keeps running over budget, and back
+        double cpuMs = (glfwGetTime() - frameStart) * 1000.0;
+        if (quality.Update(cpuMs, gpuOverloadMs.load())) {
+            activeRain = NUMBER_OF_RAIN_PARTICLE * (4 - quality.Level(rainKnob)) / 4;
+            for (unsigned int e = 0; e < smokeEmitter.size(); ++e) {
+                smokeEmitter[e].Rate = smokeEmitRate[e] * (3 - quality.Level(smokeKnob)) / 3.0f;
+            }
+        }
+
+#ifdef FRAME_ARENA_COUNT_HEAP
+        unsigned long long heapAllocations = EndHeapCheck();
+        if (++simulationFrames > HEAP_CHECK_WARMUP_FRAMES && heapAllocations > 0) {
+            LOG_WARN("simulation thread: {} heap allocations in frame {}, the frame loop should not allocate", heapAllocations, simulationFrames);
+        }
+#endif
+
+        // wait until the render thread has taken the snapshot, so this thread stays one frame ahead
+        // and the frame time is the slower of simulation and rendering rather than their sum
+        while (rendering && !frames.WaitUntilConsumed(std::chrono::milliseconds(100))) {
+        }
+
+        // glfw: poll IO events (keys pressed/released, mouse moved etc.), the pacer decides
+        // whether to wait for them
+        // ---------------------------------------------------------------------------------
+        if (framePacer.EndFrame(!simulationPaused)) {
+            glfwWaitEvents();
+        }
+        else {
+            glfwPollEvents();
+        }
+    }
+
+    // stop the render thread, it releases the GL resources before the context goes away
+    rendering = false;
+    renderer.join();
+
+    // glfw: terminate, clearing all previously allocated GLFW resources.
+    // ------------------------------------------------------------------
+    glfwTerminate();
+    return 0;
+}
+
+// render thread: owns the GL context and draws the latest snapshot published by the main thread
+// ---------------------------------------------------------------------------------------------
+void renderThread(GLFWwindow *window, TripleBuffer<FrameSnapshot> &frames, JobSystem &jobs)
+{
+    glfwMakeContextCurrent(window);
+
+    // glad: load all OpenGL function pointers
+    // ---------------------------------------
+    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    {
+        LOG_ERROR("Failed to initialize GLAD");
+        rendering = false;
+        glfwMakeContextCurrent(NULL);
+        return;
     }
 
+    // configure global opengl state
+    // -----------------------------
+    glEnable(GL_DEPTH_TEST);
+
+    // build and compile our shader zprogram
+    // ------------------------------------
+    Shader lightingShader("lighting.vs", "lighting.fs");
+    Shader lampShader("lamp.vs", "lamp.fs");
+    Shader groundShader("ground.vs", "ground.fs");
+    Shader particleShader("particle.vs", "particle.fs");
+    Shader waterShader("water.vs", "water.fs");
+
+    // set up vertex data (and buffer(s)) and configure vertex attributes
+    // ------------------------------------------------------------------
+    float vertices[] = {
+            -0.5f, -0.5f, -1.0f,  0.0f, 0.0f, 0.0f,  0.0f, -1.0f,
+            0.5f, -0.5f, -1.0f,  1.0f, 0.0f, 0.0f,  0.0f, -1.0f,
+            0.5f,  0.5f, -1.0f,  1.0f, 1.0f, 0.0f,  0.0f, -1.0f,
+            0.5f,  0.5f, -1.0f,  1.0f, 1.0f, 0.0f,  0.0f, -1.0f,
+            -0.5f,  0.5f, -1.0f,  0.0f, 1.0f, 0.0f,  0.0f, -1.0f,
+            -0.5f, -0.5f, -1.0f,  0.0f, 0.0f, 0.0f,  0.0f, -1.0f,
+
+            -0.5f, -0.5f,  1.0f,  0.0f, 0.0f, 0.0f,  0.0f,  1.0f,
+            0.5f, -0.5f,  1.0f,  1.0f, 0.0f, 0.0f,  0.0f,  1.0f,
+            0.5f,  0.5f,  1.0f,  1.0f, 1.0f, 0.0f,  0.0f,  1.0f,
+            0.5f,  0.5f,  1.0f,  1.0f, 1.0f, 0.0f,  0.0f,  1.0f,
+            -0.5f,  0.5f,  1.0f,  0.0f, 1.0f, 0.0f,  0.0f,  1.0f,
+            -0.5f, -0.5f,  1.0f,  0.0f, 0.0f, 0.0f,  0.0f,  1.0f,
+
+            -0.5f,  0.5f,  1.0f,  1.0f, 0.0f, -1.0f,  0.0f,  0.0f,
+            -0.5f,  0.5f, -1.0f,  1.0f, 1.0f, -1.0f,  0.0f,  0.0f,
+            -0.5f, -0.5f, -1.0f,  0.0f, 1.0f, -1.0f,  0.0f,  0.0f,
+            -0.5f, -0.5f, -1.0f,  0.0f, 1.0f, -1.0f,  0.0f,  0.0f,
+            -0.5f, -0.5f,  1.0f,  0.0f, 0.0f, -1.0f,  0.0f,  0.0f,
+            -0.5f,  0.5f,  1.0f,  1.0f, 0.0f, -1.0f,  0.0f,  0.0f,
+
+            0.5f,  0.5f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f,  0.0f,
+            0.5f,  0.5f, -1.0f,  1.0f, 1.0f, 1.0f,  0.0f,  0.0f,
+            0.5f, -0.5f, -1.0f,  0.0f, 1.0f, 1.0f,  0.0f,  0.0f,
+            0.5f, -0.5f, -1.0f,  0.0f, 1.0f, 1.0f,  0.0f,  0.0f,
+            0.5f, -0.5f,  1.0f,  0.0f, 0.0f, 1.0f,  0.0f,  0.0f,
+            0.5f,  0.5f,  1.0f,  1.0f, 0.0f, 1.0f,  0.0f,  0.0f,
+
+            -0.5f, -0.5f, -1.0f,  0.0f, 1.0f, 0.0f, -1.0f,  0.0f,
+            0.5f, -0.5f, -1.0f,  1.0f, 1.0f, 0.0f, -1.0f,  0.0f,
+            0.5f, -0.5f,  1.0f,  1.0f, 0.0f, 0.0f, -1.0f,  0.0f,
+            0.5f, -0.5f,  1.0f,  1.0f, 0.0f, 0.0f, -1.0f,  0.0f,
+            -0.5f, -0.5f,  1.0f,  0.0f, 0.0f, 0.0f, -1.0f,  0.0f,
+            -0.5f, -0.5f, -1.0f,  0.0f, 1.0f, 0.0f, -1.0f,  0.0f,
+
+            -0.5f,  0.5f, -1.0f,  0.0f, 1.0f, 0.0f,  1.0f,  0.0f,
+            0.5f,  0.5f, -1.0f,  1.0f, 1.0f, 0.0f,  1.0f,  0.0f,
+            0.5f,  0.5f,  1.0f,  1.0f, 0.0f, 0.0f,  1.0f,  0.0f,
+            0.5f,  0.5f,  1.0f,  1.0f, 0.0f, 0.0f,  1.0f,  0.0f,
+            -0.5f,  0.5f,  1.0f,  0.0f, 0.0f, 0.0f,  1.0f,  0.0f,
+            -0.5f,  0.5f, -1.0f,  0.0f, 1.0f,  0.0f,  1.0f,  0.0f
+    };
+
+    // particles are instanced camera-facing quads, the corners are expanded in the vertex shader
+    float quad[] = {
+            -0.5f, -0.5f,
+            0.5f, -0.5f,
+            -0.5f,  0.5f,
+            0.5f,  0.5f
+    };
+
+    float ground[] = { // consist of two triangle
+            10.0f, 10.0f, 10.0f,
+            -10.0f, 10.0f, 10.0f,
+            -10.0f, -10.0f, 10.0f,
+
+            -10.0f, 10.0f, 10.0f,
+            -10.0f, -10.0f, 10.0f,
+            10.0f, -10.0f, 10.0f
+    };
+
     // first, configure the cube's VAO (and VBO)
     unsigned int VBO, cubeVAO;
     glGenVertexArrays(1, &cubeVAO);
@@ -350,81 +950,80 @@ int main()
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
     glEnableVertexAttribArray(2);
 
+    // particle VAOs: a shared quad plus one per-instance vec4 stream per particle system
+    unsigned int quadVBO, smokeInstanceVBO, rainInstanceVBO, smokeVAO, rainVAO;
+    glGenBuffers(1, &quadVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+
+    glGenBuffers(1, &smokeInstanceVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, smokeInstanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, NUMBER_OF_SMOKE_PARTICLE * sizeof(glm::vec4), NULL, GL_STREAM_DRAW);
+
+    glGenBuffers(1, &rainInstanceVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, rainInstanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, NUMBER_OF_RAIN_PARTICLE * sizeof(glm::vec4), NULL, GL_STREAM_DRAW);
+
+    glGenVertexArrays(1, &smokeVAO);
+    glGenVertexArrays(1, &rainVAO);
+    unsigned int particleVAOs[] = { smokeVAO, rainVAO };
+    unsigned int instanceVBOs[] = { smokeInstanceVBO, rainInstanceVBO };
+    for (int k = 0; k < 2; ++k) {
+        glBindVertexArray(particleVAOs[k]);
+        // corner attribute
+        glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+        // instance attribute, advances once per particle
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBOs[k]);
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(3);
+        glVertexAttribDivisor(3, 1);
+    }
+
     // load and create a texture
     // -------------------------
+    // the images are decoded by worker threads, the GL uploads are queued back to this thread
     unsigned int texture1, texture2, texture3;
-    // texture 1
-    // ---------
-    glGenTextures(1, &texture1);
-    glBindTexture(GL_TEXTURE_2D, texture1);
-    // set the texture wrapping parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    // set texture filtering parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // load image, create texture and generate mipmaps
-    int width, height, nrChannels;
-    stbi_set_flip_vertically_on_load(true); // tell stb_image.h to flip loaded texture's on the y-axis.
-    unsigned char *data = stbi_load(FileSystem::getPath("textures/tentara.jpg").c_str(), &width, &height, &nrChannels, 0);
-    if (data)
-    {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else
-    {
-        std::cout << "Failed to load texture" << std::endl;
-    }
-    stbi_image_free(data);
-
-    // texture 2
-    // ---------
-    glGenTextures(1, &texture2);
-    glBindTexture(GL_TEXTURE_2D, texture2);
-    // set the texture wrapping parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    // set texture filtering parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // load image, create texture and generate mipmaps
-    stbi_set_flip_vertically_on_load(true); // tell stb_image.h to flip loaded texture's on the y-axis.
-    unsigned char *data_glass = stbi_load(FileSystem::getPath("textures/glass.jpg").c_str(), &width, &height, &nrChannels, 0);
-    if (data_glass)
-    {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data_glass);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else
-    {
-        std::cout << "Failed to load texture" << std::endl;
-    }
-    stbi_image_free(data_glass);
-
-    // texture 3
-    // ---------
-    glGenTextures(1, &texture3);
-    glBindTexture(GL_TEXTURE_2D, texture3);
-    // set the texture wrapping parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    // set texture filtering parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    // load image, create texture and generate mipmaps
+    unsigned int *textureID[] = { &texture1, &texture2, &texture3 };
+    const char *texturePath[] = { "textures/tentara.jpg", "textures/glass.jpg", "textures/rubber.jpg" };
     stbi_set_flip_vertically_on_load(true); // tell stb_image.h to flip loaded texture's on the y-axis.
-    unsigned char *data_rubber = stbi_load(FileSystem::getPath("textures/rubber.jpg").c_str(), &width, &height, &nrChannels, 0);
-    if (data_rubber)
+    Job *textureLoad = jobs.Create([] {});
+    for (int t = 0; t < 3; ++t)
     {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data_rubber);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else
-    {
-        std::cout << "Failed to load texture" << std::endl;
+        glGenTextures(1, textureID[t]);
+        glBindTexture(GL_TEXTURE_2D, *textureID[t]);
+        // set the texture wrapping parameters
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        // set texture filtering parameters
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        unsigned int texture = *textureID[t];
+        const char *path = texturePath[t];
+        jobs.Run(jobs.CreateChild(textureLoad, [&jobs, texture, path] {
+            // load image, then create the texture and generate mipmaps on the render thread
+            int width, height, nrChannels;
+            unsigned char *data = stbi_load(FileSystem::getPath(path).c_str(), &width, &height, &nrChannels, 0);
+            jobs.RunOnGLThread([texture, path, data, width, height] {
+                if (data)
+                {
+                    glBindTexture(GL_TEXTURE_2D, texture);
+                    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+                    glGenerateMipmap(GL_TEXTURE_2D);
+                }
+                else
+                {
+                    LOG_ERROR("Failed to load texture {}", path);
+                }
+                stbi_image_free(data);
+            });
+        }));
     }
-    stbi_image_free(data_rubber);
+    jobs.Run(textureLoad);
+    jobs.Wait(textureLoad);
+    jobs.DrainGLThread();
 
     // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
     // -------------------------------------------------------------------------------------------
@@ -433,225 +1032,716 @@ int main()
     lightingShader.setInt("texture2", 1);
     lightingShader.setInt("texture3", 2);
 
+    // GPU culling: every box is a point in boxInstanceVBO, a geometry shader keeps those in view
+    // and transform feedback packs them into one of the culled buffers, which is drawn instanced.
+    // The number kept is read from a query once it is ready, so the draw uses the newest culled
+    // buffer whose count is known and the CPU does not wait for the cull of the same frame.
+    const char *cullVaryings[] = { "CulledPlacement", "CulledScale" };
+    Shader cullShader("cull.vs", "cull.gs", cullVaryings, 2);
+    cullShader.use();
+    cullShader.setVec3("cubeHalfExtent", CUBE_HALF_EXTENT);
+    cullShader.setFloat("margin", GPU_CULL_MARGIN);
+    cullShader.setFloat("minSize", GPU_CULL_MIN_SIZE);
+    Shader instancedShader("lighting_instanced.vs", "lighting_instanced.fs");
+    Shader depthInstancedShader("depth_instanced.vs", "lamp.fs");
+    instancedShader.use();
+    instancedShader.setInt("texture1", 0);
+    instancedShader.setInt("texture2", 1);
+    instancedShader.setInt("texture3", 2);
+    unsigned int boxInstanceVBO, cullVAO;
+    unsigned int culledVBO[GPU_CULL_BUFFERS], culledVAO[GPU_CULL_BUFFERS], culledQuery[GPU_CULL_BUFFERS];
+    bool culledPending[GPU_CULL_BUFFERS] = { false };
+    unsigned int culledCount[GPU_CULL_BUFFERS] = { 0 };
+    unsigned int culledFrame[GPU_CULL_BUFFERS] = { 0 };
+    glm::mat4 culledViewProjection[GPU_CULL_BUFFERS];
+    glGenBuffers(1, &boxInstanceVBO);
+    glGenBuffers(GPU_CULL_BUFFERS, culledVBO);
+    glGenVertexArrays(1, &cullVAO);
+    glGenVertexArrays(GPU_CULL_BUFFERS, culledVAO);
+    glGenQueries(GPU_CULL_BUFFERS, culledQuery);
+    // the cull reads the two vec4 of every box as vertex attributes
+    glBindVertexArray(cullVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, boxInstanceVBO);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(4 * sizeof(float)));
+    glEnableVertexAttribArray(1);
+    // the draws take the cube from VBO and advance through the culled boxes once per instance
+    for (int c = 0; c < GPU_CULL_BUFFERS; ++c) {
+        glBindVertexArray(culledVAO[c]);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(5 * sizeof(float)));
+        glEnableVertexAttribArray(1);
+        glBindBuffer(GL_ARRAY_BUFFER, culledVBO[c]);
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(3);
+        glVertexAttribDivisor(3, 1);
+        glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(4 * sizeof(float)));
+        glEnableVertexAttribArray(4);
+        glVertexAttribDivisor(4, 1);
+    }
+    unsigned long boxInstancesVersion = ~0ul;
+    unsigned int boxInstanceCount = 0;
+    unsigned int cullFrame = 0;
+    int culledLatest = -1; // newest culled buffer with a known count
+
+    // the scene is drawn into an offscreen target at a fraction of the window size and then
+    // upscaled, the fraction follows the measured GPU time
+    Shader upscaleShader("upscale.vs", "upscale.fs");
+    upscaleShader.use();
+    upscaleShader.setInt("scene", 0);
+    unsigned int sceneFBO, sceneColor, sceneDepth, upscaleVAO;
+    glGenFramebuffers(1, &sceneFBO);
+    glGenTextures(1, &sceneColor);
+    glGenTextures(1, &sceneDepth);
+    glGenVertexArrays(1, &upscaleVAO); // empty, the fullscreen triangle comes from gl_VertexID
+    int targetWidth = 0, targetHeight = 0;
+
+    // color and depth of the static passes, kept between frames and copied into the scene
+    // target while nothing they show has changed; the particles are then drawn on top of it
+    unsigned int staticFBO, staticColor, staticDepth;
+    glGenFramebuffers(1, &staticFBO);
+    glGenTextures(1, &staticColor);
+    glGenTextures(1, &staticDepth);
+    bool staticValid = false;
+    glm::mat4 staticView, staticProjection;
+    glm::vec3 staticLightPos;
+    unsigned long staticSceneVersion = 0;
+    OcclusionMode staticOcclusion = OCCLUSION_OFF;
+    bool staticGpuCulling = false;
+    bool staticDepthPrepass = false;
+    int staticWidth = 0, staticHeight = 0;
+
+    // the particles are drawn into a target a fraction of the scene's size, depth tested against
+    // a downsampled copy of the scene depth, and blended back with a depth-aware upsample
+    Shader depthDownsampleShader("upscale.vs", "particle_downsample.fs");
+    depthDownsampleShader.use();
+    depthDownsampleShader.setInt("sceneDepth", 0);
+    depthDownsampleShader.setInt("divisor", PARTICLE_RESOLUTION_DIVISOR);
+    Shader particleCompositeShader("upscale.vs", "particle_composite.fs");
+    particleCompositeShader.use();
+    particleCompositeShader.setInt("particles", 0);
+    particleCompositeShader.setInt("particleDepth", 1);
+    particleCompositeShader.setInt("sceneDepth", 2);
+    particleCompositeShader.setInt("divisor", PARTICLE_RESOLUTION_DIVISOR);
+    unsigned int particleFBO, particleColor, particleDepth, compositeFBO;
+    glGenFramebuffers(1, &particleFBO);
+    glGenTextures(1, &particleColor);
+    glGenTextures(1, &particleDepth);
+    // the scene color alone, so the composite can read the scene depth while it draws
+    glGenFramebuffers(1, &compositeFBO);
+
+    // (re)allocates the color and depth textures of an offscreen target
+    auto allocateTarget = [](unsigned int fbo, unsigned int color, unsigned int depth, int width, int height) {
+        glBindTexture(GL_TEXTURE_2D, color);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, depth);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            LOG_ERROR("Offscreen framebuffer is not complete");
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    };
+    ResolutionScaler resolutionScaler(DYNAMIC_RESOLUTION_MIN_SCALE, DYNAMIC_RESOLUTION_MAX_SCALE, DYNAMIC_RESOLUTION_TARGET_MS);
+
+    // GPU frame time, results are collected a few frames later so reading them never stalls
+    unsigned int gpuTimer[GPU_TIMER_QUERIES];
+    bool gpuTimerPending[GPU_TIMER_QUERIES] = { false };
+    glGenQueries(GPU_TIMER_QUERIES, gpuTimer);
+    unsigned int gpuFrame = 0;
+
+    // samples the opaque shading pass wrote, over the pixels of the target it is the overdraw;
+    // read when ready like the timers
+    unsigned int shadedQuery;
+    glGenQueries(1, &shadedQuery);
+    bool shadedPending = false, shadedPrepass = false;
+    unsigned long long shadedPixels = 1;
+
+    // hardware occlusion, one query per group of boxes; results are read when they are ready,
+    // usually a frame later, so the CPU never waits for them and a group that comes into view
+    // shows up a frame late
+    vector<unsigned int> groupQuery;
+    vector<char> groupPending, groupVisible;
+    unsigned int groupBuilds = 0;
+
+    int viewportWidth = 0, viewportHeight = 0;
+    int swapInterval = -1;
+    unsigned int boxTexture[] = { 0, texture1, texture2, texture3 };
+    FrameArena renderArena(FRAME_ARENA_SIZE);
+    unsigned long long renderFrames = 0;
 
     // render loop
     // -----------
-    while (!glfwWindowShouldClose(window))
+    while (rendering)
     {
-        // per-frame time logic
-        // --------------------
-        float currentFrame = glfwGetTime();
-        deltaTime = currentFrame - lastFrame;
-        lastFrame = currentFrame;
-
-        // input
-        // -----
-        processInput(window);
+        // GL work handed back by the workers
+        jobs.DrainGLThread();
+
+        if (!frames.WaitAndAcquire(std::chrono::milliseconds(100)))
+            continue;
+        const FrameSnapshot &frame = frames.Front();
+#ifdef FRAME_ARENA_COUNT_HEAP
+        BeginHeapCheck();
+#endif
 
-        // render
-        // ------
-        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-        // be sure to activate shader when setting uniforms/drawing objects
-        particleShader.use();
-        particleShader.setVec3("objectColor", 0.0f, 0.0f, 1.0f);
-        particleShader.setVec3("lightColor", 1.0f, 1.0f, 1.0f);
-        particleShader.setVec3("lightPos", lightPos);
-        particleShader.setVec3("viewPos", camera.Position);
-
-        // view/projection transformations
-        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-        glm::mat4 view = camera.GetViewMatrix();
-        particleShader.setMat4("projection", projection);
-        particleShader.setMat4("view", view);
-
-        // world transformation
-        glm::mat4 model = glm::mat4(1.0f);
-        particleShader.setMat4("model", model);
-
-        // drawing smoke
-        // smoke color
-        glm::mat4 colours = glm::mat4(1.0f); // make sure to initialize matrix to identity matrix first
-        colours = glm::scale(colours, glm::vec3(0.6f)); // colours are grey
-        for (int j = 0; j < NUMBER_OF_SMOKE_PARTICLE; ++j) {
-            // update position
-            smokeParticle[j].decaytime -= LIFESPAN_PER_CYCLE;
-            if (smokeParticle[j].decaytime < 0) {
-                smokeParticle[j].x = START_X;
-                smokeParticle[j].y = START_Y;
-                smokeParticle[j].z = START_Z;
-                smokeParticle[j].decaytime = rand()%(SMOKE_MAX_LIFETIME + 1);
-                smokeParticle[j].halftime = smokeParticle[j].decaytime / 2;
-                smokeParticle[j].x_speed = static_cast<float>(-PARTICLE_SPEED + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (PARTICLE_SPEED * 2))));
-                smokeParticle[j].y_speed = static_cast<float>(PARTICLE_MIN_SPEED + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (PARTICLE_MAX_SPEED - PARTICLE_MIN_SPEED))));
-                smokeParticle[j].z_speed = static_cast<float>(PARTICLE_MIN_SPEED + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (PARTICLE_MAX_SPEED - PARTICLE_MIN_SPEED))));
-            }
-            else if (smokeParticle[j].decaytime < smokeParticle[j].halftime) {
-                smokeParticle[j].x += smokeParticle[j].x_speed;
-                smokeParticle[j].y += smokeParticle[j].y_speed;
-                smokeParticle[j].z += smokeParticle[j].z_speed;
+        // make sure the offscreen target matches the window dimensions at the largest scale;
+        // note that width and height will be significantly larger than specified on retina displays.
+        if (frame.Width != viewportWidth || frame.Height != viewportHeight) {
+            viewportWidth = frame.Width;
+            viewportHeight = frame.Height;
+            targetWidth = std::max(1, (int)std::ceil(viewportWidth * DYNAMIC_RESOLUTION_MAX_SCALE));
+            targetHeight = std::max(1, (int)std::ceil(viewportHeight * DYNAMIC_RESOLUTION_MAX_SCALE));
+
+            allocateTarget(sceneFBO, sceneColor, sceneDepth, targetWidth, targetHeight);
+            allocateTarget(staticFBO, staticColor, staticDepth, targetWidth, targetHeight);
+            staticValid = false;
+            if (PARTICLE_RESOLUTION_DIVISOR > 1) {
+                allocateTarget(particleFBO, particleColor, particleDepth,
+                               (targetWidth + PARTICLE_RESOLUTION_DIVISOR - 1) / PARTICLE_RESOLUTION_DIVISOR,
+                               (targetHeight + PARTICLE_RESOLUTION_DIVISOR - 1) / PARTICLE_RESOLUTION_DIVISOR);
+                glBindFramebuffer(GL_FRAMEBUFFER, compositeFBO);
+                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneColor, 0);
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
             }
-            else {
-                smokeParticle[j].x += smokeParticle[j].x_speed;
-                smokeParticle[j].z += smokeParticle[j].z_speed;
-            }
-
-            // calculate the model matrix for each object and pass it to shader before drawing
-            glm::mat4 model = glm::mat4(1.0f); // make sure to initialize matrix to identity matrix first
-            model = glm::translate(model, glm::vec3(smokeParticle[j].x, smokeParticle[j].y, smokeParticle[j].z));
-            float angle = 0;
-            model = glm::scale(model, glm::vec3(0.05f, 0.05f, 0.05f));
-            model = glm::rotate(model, glm::radians(angle), glm::vec3(1.0f, 0.3f, 0.5f));
-            particleShader.setMat4("model", model);
-
-            particleShader.setMat4("aColor", colours);
-            glDrawArrays(GL_TRIANGLES, 0, 36);
-        }
-
-        // be sure to activate shader when setting uniforms/drawing objects
-        waterShader.use();
-        waterShader.setVec3("objectColor", 0.0f, 0.0f, 1.0f);
-        waterShader.setVec3("lightColor", 1.0f, 1.0f, 1.0f);
-        waterShader.setVec3("lightPos", lightPos);
-        waterShader.setVec3("viewPos", camera.Position);
-
-        // view/projection transformations
-        projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-        view = camera.GetViewMatrix();
-        waterShader.setMat4("projection", projection);
-        waterShader.setMat4("view", view);
-
-        // world transformation
-        model = glm::mat4(1.0f);
-        waterShader.setMat4("model", model);
-
-        // drawing rain
-        // rain color
-        colours = glm::mat4(1.0f); // make sure to initialize matrix to identity matrix first
-        colours = glm::scale(colours, glm::vec3(0.0f, 1.0f, 1.0f)); // colours are blue light
-        for (int i = 0; i < NUMBER_OF_RAIN_PARTICLE; ++i) {
-            // update rain
-            rainParticle[i].y -= rainParticle[i].speed;
-            if (rainParticle[i].y < WORLD_BOTTOM) {
-                rainParticle[i].x = static_cast<float>(WORLD_LEFT + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (WORLD_RIGHT - WORLD_LEFT))));
-                rainParticle[i].z = static_cast<float>(WORLD_FRONT + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (WORLD_BACK - WORLD_FRONT))));
-                rainParticle[i].y = WORLD_TOP;
-                rainParticle[i].speed = static_cast<float>(PARTICLE_MIN_SPEED + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (PARTICLE_MAX_SPEED - PARTICLE_MIN_SPEED))));
-                cout << "regenerate particle " << i << " : " << rainParticle[i].x << " " << rainParticle[i].y << " " << rainParticle[i].z << " " << rainParticle[i].speed << endl;
-            }
-
-            // calculate the model matrix for each object and pass it to shader before drawing
-            glm::mat4 model = glm::mat4(1.0f); // make sure to initialize matrix to identity matrix first
-            model = glm::translate(model, glm::vec3(rainParticle[i].x, rainParticle[i].y, rainParticle[i].z));
-            float angle = 0.0f * i;
-            model = glm::scale(model, glm::vec3(0.05f, 0.2f, 0.05f));
-            model = glm::rotate(model, glm::radians(angle), glm::vec3(1.0f, 0.3f, 0.5f));
-            waterShader.setMat4("model", model);
-
-            waterShader.setMat4("aColor", colours);
-            glDrawArrays(GL_TRIANGLES, 0, 36);
-        }
-
-
-        // be sure to activate shader when setting uniforms/drawing objects
-        lightingShader.use();
-        lightingShader.setVec3("objectColor", 0.0f, 0.0f, 1.0f);
-        lightingShader.setVec3("lightColor", 1.0f, 1.0f, 1.0f);
-        lightingShader.setVec3("lightPos", lightPos);
-        lightingShader.setVec3("viewPos", camera.Position);
-
-        // view/projection transformations
-        projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-        view = camera.GetViewMatrix();
-        lightingShader.setMat4("projection", projection);
-        lightingShader.setMat4("view", view);
-
-        // world transformation
-        model = glm::mat4(1.0f);
-        lightingShader.setMat4("model", model);
-
-        // render the cube
-        // render boxes
-        glBindVertexArray(cubeVAO);
-        for (unsigned int i = 0; i < scaler.size(); i++)
-        {
-            if (cubeTexture[i] == 1) {
-                // bind textures on corresponding texture units
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, texture1);
-            }
-            else if (cubeTexture[i] == 2) {
-                // bind textures on corresponding texture units
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, texture2);
-            }
-            else if (cubeTexture[i] == 3) {
-                // bind textures on corresponding texture units
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, texture3);
-            }
-            // calculate the model matrix for each object and pass it to shader before drawing
-            glm::mat4 model = glm::mat4(1.0f); // make sure to initialize matrix to identity matrix first
-            model = glm::translate(model, cubePositions[i]);
-            float angle = 0.0f * i;
-            model = glm::scale(model, cubeScaler[i]);
-            model = glm::rotate(model, glm::radians(angle), glm::vec3(1.0f, 0.3f, 0.5f));
-            lightingShader.setMat4("model", model);
-
-            // box color
-            glm::mat4 colours = glm::mat4(1.0f); // make sure to initialize matrix to identity matrix first
-            colours = glm::scale(colours, cubeColor[i]);
-            lightingShader.setMat4("aColor", colours);
-
-            glDrawArrays(GL_TRIANGLES, 0, 36);
+        }
+        if (frame.SwapInterval != swapInterval) {
+            swapInterval = frame.SwapInterval;
+            glfwSwapInterval(swapInterval);
         }
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture1);
+        renderArena.Reset();
+
+        // occlusion groups, starting out visible whenever they are renumbered
+        if (frame.Groups.size() != groupQuery.size() || frame.GroupBuilds != groupBuilds) {
+            if (!groupQuery.empty())
+                glDeleteQueries(groupQuery.size(), groupQuery.data());
+            groupQuery.assign(frame.Groups.size(), 0);
+            if (!groupQuery.empty())
+                glGenQueries(groupQuery.size(), groupQuery.data());
+            groupPending.assign(frame.Groups.size(), 0);
+            groupVisible.assign(frame.Groups.size(), 1);
+            groupBuilds = frame.GroupBuilds;
+            staticValid = false;
+        }
+        for (unsigned int g = 0; g < groupQuery.size(); ++g) {
+            if (!groupPending[g])
+                continue;
+            int available = 0;
+            glGetQueryObjectiv(groupQuery[g], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                continue;
+            unsigned int samples = 0;
+            glGetQueryObjectuiv(groupQuery[g], GL_QUERY_RESULT, &samples);
+            // the cached static layer was drawn with the old answer
+            if (groupVisible[g] != (samples != 0))
+                staticValid = false;
+            groupVisible[g] = samples != 0;
+            groupPending[g] = 0;
+        }
 
+        // every box goes to the GPU once per scene edit; the culled buffers are sized for all of them
+        if (frame.GpuCulling && frame.BoxInstancesVersion != boxInstancesVersion) {
+            boxInstanceCount = frame.BoxInstances.size() / 2;
+            glBindBuffer(GL_ARRAY_BUFFER, boxInstanceVBO);
+            glBufferData(GL_ARRAY_BUFFER, frame.BoxInstances.size() * sizeof(glm::vec4), frame.BoxInstances.data(), GL_STATIC_DRAW);
+            for (int c = 0; c < GPU_CULL_BUFFERS; ++c) {
+                glBindBuffer(GL_ARRAY_BUFFER, culledVBO[c]);
+                glBufferData(GL_ARRAY_BUFFER, frame.BoxInstances.size() * sizeof(glm::vec4), NULL, GL_DYNAMIC_COPY);
+                // a cull still in flight wrote the old boxes, its count is dropped
+                if (culledPending[c]) {
+                    unsigned int stale = 0;
+                    glGetQueryObjectuiv(culledQuery[c], GL_QUERY_RESULT, &stale);
+                    culledPending[c] = false;
+                }
+            }
+            boxInstancesVersion = frame.BoxInstancesVersion;
+            culledLatest = -1;
+            staticValid = false;
+        }
+        // counts of the culls that have finished
+        for (int c = 0; c < GPU_CULL_BUFFERS; ++c) {
+            if (!culledPending[c])
+                continue;
+            int available = 0;
+            glGetQueryObjectiv(culledQuery[c], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                continue;
+            glGetQueryObjectuiv(culledQuery[c], GL_QUERY_RESULT, &culledCount[c]);
+            culledPending[c] = false;
+            if (culledLatest < 0 || culledFrame[c] > culledFrame[culledLatest])
+                culledLatest = c;
+        }
 
-        // also draw the lamp object
-        lampShader.use();
-        lampShader.setMat4("projection", projection);
-        lampShader.setMat4("view", view);
-        model = glm::mat4(1.0f);
-        model = glm::translate(model, lightPos);
-        model = glm::scale(model, glm::vec3(0.2f)); // a smaller cube
-        lampShader.setMat4("model", model);
+        if (shadedPending) {
+            int available = 0;
+            glGetQueryObjectiv(shadedQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available) {
+                GLuint64 samples = 0;
+                glGetQueryObjectui64v(shadedQuery, GL_QUERY_RESULT, &samples);
+                shadedPending = false;
+                opaqueOverdraw = (float)((double)samples / shadedPixels);
+                opaqueOverdrawPrepass = shadedPrepass;
+            }
+        }
 
-        glBindVertexArray(lightVAO);
-        glDrawArrays(GL_TRIANGLES, 0, 36);
+        // collect the GPU times that are ready and let them steer the resolution
+        for (unsigned int q = 0; q < GPU_TIMER_QUERIES; ++q) {
+            if (!gpuTimerPending[q])
+                continue;
+            int available = 0;
+            glGetQueryObjectiv(gpuTimer[q], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                continue;
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(gpuTimer[q], GL_QUERY_RESULT, &nanoseconds);
+            gpuTimerPending[q] = false;
+            if (resolutionScaler.Update(nanoseconds / 1.0e6)) {
+                LOG_INFO("resolution scale {} (gpu {} ms, target {} ms)", resolutionScaler.Scale(), resolutionScaler.AverageMs(), resolutionScaler.TargetMs());
+            }
+            // at the lowest scale the rest of the GPU load is left to the quality governor
+            bool lowest = resolutionScaler.Scale() <= DYNAMIC_RESOLUTION_MIN_SCALE;
+            gpuOverloadMs = lowest ? (float)resolutionScaler.AverageMs() : 0.0f;
+        }
+        // a query still in flight is not reused, that frame just goes unmeasured
+        unsigned int timer = gpuFrame++ % GPU_TIMER_QUERIES;
+        bool timing = !gpuTimerPending[timer];
+        if (timing)
+            glBeginQuery(GL_TIME_ELAPSED, gpuTimer[timer]);
+
+        int sceneWidth = std::max(1, (int)(viewportWidth * resolutionScaler.Scale()));
+        int sceneHeight = std::max(1, (int)(viewportHeight * resolutionScaler.Scale()));
+
+        // replay the packets in key order, shader and state only change between passes
+        FrameVector<const DrawPacket*> drawOrder((ArenaAllocator<const DrawPacket*>(renderArena)));
+        frame.Draws.Merge(drawOrder);
+        auto replay = [&](unsigned int first, unsigned int last) {
+            unsigned int pass = PASS_COUNT;
+            const Shader *shader = NULL;
+            int boundTexture = -1;
+            for (unsigned int k = first; k < last; ++k)
+            {
+                const DrawPacket &packet = *drawOrder[k];
+                if (packet.Group >= 0 && !groupVisible[packet.Group])
+                    continue;
+                if (packet.Pass != pass) {
+                    pass = packet.Pass;
+                    if (pass == PASS_BOXES) {
+                        // be sure to activate shader when setting uniforms/drawing objects
+                        shader = &lightingShader;
+                        lightingShader.use();
+                        lightingShader.setVec3("objectColor", 0.0f, 0.0f, 1.0f);
+                        lightingShader.setVec3("lightColor", 1.0f, 1.0f, 1.0f);
+                        lightingShader.setVec3("lightPos", frame.LightPos);
+                        lightingShader.setVec3("viewPos", frame.ViewPos);
+                        glBindVertexArray(cubeVAO);
+                    }
+                    else if (pass == PASS_LAMP) {
+                        shader = &lampShader;
+                        lampShader.use();
+                        glBindVertexArray(lightVAO);
+                    }
+                    else if (pass == PASS_GROUND) {
+                        shader = &groundShader;
+                        groundShader.use();
+                        glBindVertexArray(lightVAO);
+                    }
+                    else if (pass == PASS_RAIN) {
+                        shader = &waterShader;
+                        waterShader.use();
+                        waterShader.setVec3("objectColor", 0.0f, 0.0f, 1.0f);
+                        waterShader.setVec3("lightColor", 1.0f, 1.0f, 1.0f);
+                        waterShader.setVec3("lightPos", frame.LightPos);
+                        waterShader.setVec3("viewPos", frame.ViewPos);
+                        waterShader.setVec3("cameraRight", frame.CameraRight);
+                        waterShader.setFloat("streakWidth", RAIN_STREAK_WIDTH);
+                        waterShader.setFloat("streakLength", RAIN_STREAK_LENGTH);
+                        // drops are stretched along the fall direction
+                        glBindBuffer(GL_ARRAY_BUFFER, rainInstanceVBO);
+                        glBufferSubData(GL_ARRAY_BUFFER, 0, frame.Rain.size() * sizeof(glm::vec4), frame.Rain.data());
+                        glBindVertexArray(rainVAO);
+                    }
+                    else if (pass == PASS_SMOKE) {
+                        shader = &particleShader;
+                        particleShader.use();
+                        particleShader.setVec3("objectColor", 0.0f, 0.0f, 1.0f);
+                        particleShader.setVec3("lightColor", 1.0f, 1.0f, 1.0f);
+                        particleShader.setVec3("lightPos", frame.LightPos);
+                        particleShader.setVec3("viewPos", frame.ViewPos);
+                        particleShader.setVec3("cameraRight", frame.CameraRight);
+                        particleShader.setVec3("cameraUp", frame.CameraUp);
+                        particleShader.setFloat("opacity", SMOKE_OPACITY);
+                        // already sorted back to front, blended without writing depth
+                        glBindBuffer(GL_ARRAY_BUFFER, smokeInstanceVBO);
+                        glBufferSubData(GL_ARRAY_BUFFER, 0, frame.Smoke.size() * sizeof(glm::vec4), frame.Smoke.data());
+                        glBindVertexArray(smokeVAO);
+                        // alpha accumulates coverage, which the low resolution composite needs
+                        glEnable(GL_BLEND);
+                        glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+                        glDepthMask(GL_FALSE);
+                    }
+                    // view/projection transformations
+                    shader->setMat4("projection", frame.Projection);
+                    shader->setMat4("view", frame.View);
+                }
 
-        // draw ground
-        groundShader.use();
-        groundShader.setMat4("projection", projection);
-        groundShader.setMat4("view", view);
-        model = glm::mat4(1.0f);
-        model = glm::translate(model, groundPos);
-        model = glm::scale(model, glm::vec3(20.0f, 0.1f, 20.0f)); // a smaller cube
-        groundShader.setMat4("model", model);
+                if (packet.Instances > 0) {
+                    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, packet.Instances);
+                    continue;
+                }
+                if (pass == PASS_BOXES) {
+                    // boxes without a texture of their own keep texture1
+                    int texture = (packet.Texture >= 1 && packet.Texture <= 3) ? packet.Texture : 1;
+                    if (texture != boundTexture) {
+                        // bind textures on corresponding texture units
+                        glActiveTexture(GL_TEXTURE0);
+                        glBindTexture(GL_TEXTURE_2D, boxTexture[texture]);
+                        boundTexture = texture;
+                    }
+
+                    // box color
+                    glm::mat4 colours = glm::mat4(1.0f); // make sure to initialize matrix to identity matrix first
+                    colours = glm::scale(colours, packet.Color);
+                    lightingShader.setMat4("aColor", colours);
+                    lightingShader.setMat3("normalMatrix", packet.Normal);
+                }
+                shader->setMat4("model", packet.Model);
+                glDrawArrays(GL_TRIANGLES, 0, 36);
+            }
+        };
+        // draws the bounds of every group without a query in flight against the depth of the
+        // static layer; the result decides whether the group's boxes are drawn next time
+        auto queryGroups = [&]() {
+            if (groupQuery.empty())
+                return;
+            lampShader.use();
+            lampShader.setMat4("projection", frame.Projection);
+            lampShader.setMat4("view", frame.View);
+            glBindVertexArray(lightVAO);
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            glDepthMask(GL_FALSE);
+            // the bounds touch the faces of the boxes inside, which must count as visible
+            glDepthFunc(GL_LEQUAL);
+            for (unsigned int g = 0; g < groupQuery.size(); ++g) {
+                if (groupPending[g])
+                    continue;
+                // bounds around the camera would be cut by the near plane, such groups are drawn
+                glm::vec3 lo = frame.Groups[g].Min - glm::vec3(0.2f), hi = frame.Groups[g].Max + glm::vec3(0.2f);
+                if (frame.ViewPos.x > lo.x && frame.ViewPos.y > lo.y && frame.ViewPos.z > lo.z &&
+                    frame.ViewPos.x < hi.x && frame.ViewPos.y < hi.y && frame.ViewPos.z < hi.z) {
+                    groupVisible[g] = 1;
+                    continue;
+                }
+                glm::vec3 centre = (frame.Groups[g].Min + frame.Groups[g].Max) * 0.5f;
+                glm::vec3 size = (frame.Groups[g].Max - frame.Groups[g].Min) * 1.01f;
+                glm::mat4 model = glm::scale(glm::translate(glm::mat4(1.0f), centre), size / (2.0f * CUBE_HALF_EXTENT));
+                lampShader.setMat4("model", model);
+                glBeginQuery(GL_ANY_SAMPLES_PASSED, groupQuery[g]);
+                glDrawArrays(GL_TRIANGLES, 0, 36);
+                glEndQuery(GL_ANY_SAMPLES_PASSED);
+                groupPending[g] = 1;
+            }
+            glDepthFunc(GL_LESS);
+            glDepthMask(GL_TRUE);
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        };
+
+        // culls the boxes into a free culled buffer; returns whether the newest culled set, the
+        // one drawGpuBoxes() draws, was culled for this very view, only then may the static layer
+        // keep it
+        auto cullGpuBoxes = [&]() {
+            const glm::mat4 &viewProjection = frame.ViewProjection;
+            int slot = -1;
+            for (int c = 0; c < GPU_CULL_BUFFERS && slot < 0; ++c) {
+                int candidate = (cullFrame + c) % GPU_CULL_BUFFERS;
+                if (!culledPending[candidate] && candidate != culledLatest)
+                    slot = candidate;
+            }
+            if (slot >= 0 && boxInstanceCount > 0) {
+                const Frustum &frustum = frame.ViewFrustum;
+                cullShader.use();
+                static const char *PLANE_UNIFORMS[] = { "planes[0]", "planes[1]", "planes[2]", "planes[3]", "planes[4]", "planes[5]" };
+                for (int p = 0; p < 6; ++p)
+                    cullShader.setVec4(PLANE_UNIFORMS[p], frustum.Planes[p]);
+                cullShader.setVec3("viewPos", frame.ViewPos);
+                glEnable(GL_RASTERIZER_DISCARD);
+                glBindVertexArray(cullVAO);
+                glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, culledVBO[slot]);
+                glBeginQuery(GL_PRIMITIVES_GENERATED, culledQuery[slot]);
+                glBeginTransformFeedback(GL_POINTS);
+                glDrawArrays(GL_POINTS, 0, boxInstanceCount);
+                glEndTransformFeedback();
+                glEndQuery(GL_PRIMITIVES_GENERATED);
+                glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+                glDisable(GL_RASTERIZER_DISCARD);
+                culledPending[slot] = true;
+                culledFrame[slot] = ++cullFrame;
+                culledViewProjection[slot] = viewProjection;
+                // nothing culled yet to draw instead, this once the count is waited for
+                if (culledLatest < 0) {
+                    glGetQueryObjectuiv(culledQuery[slot], GL_QUERY_RESULT, &culledCount[slot]);
+                    culledPending[slot] = false;
+                    culledLatest = slot;
+                }
+            }
+            if (culledLatest < 0)
+                return boxInstanceCount == 0;
+            gpuCulledBoxes = culledCount[culledLatest];
+            return culledViewProjection[culledLatest] == viewProjection;
+        };
+        // draws the newest culled set, lit or depth only
+        auto drawGpuBoxes = [&](bool depthOnly) {
+            if (culledLatest < 0)
+                return;
+            glBindVertexArray(culledVAO[culledLatest]);
+            if (depthOnly) {
+                depthInstancedShader.use();
+                depthInstancedShader.setMat4("projection", frame.Projection);
+                depthInstancedShader.setMat4("view", frame.View);
+                glDrawArraysInstanced(GL_TRIANGLES, 0, 36, culledCount[culledLatest]);
+                return;
+            }
+            instancedShader.use();
+            instancedShader.setVec3("objectColor", 0.0f, 0.0f, 1.0f);
+            instancedShader.setVec3("lightColor", 1.0f, 1.0f, 1.0f);
+            instancedShader.setVec3("lightPos", frame.LightPos);
+            instancedShader.setVec3("viewPos", frame.ViewPos);
+            instancedShader.setMat4("projection", frame.Projection);
+            instancedShader.setMat4("view", frame.View);
+            for (int t = 1; t <= 3; ++t) {
+                glActiveTexture(GL_TEXTURE0 + t - 1);
+                glBindTexture(GL_TEXTURE_2D, boxTexture[t]);
+            }
+            glActiveTexture(GL_TEXTURE0);
+            glDrawArraysInstanced(GL_TRIANGLES, 0, 36, culledCount[culledLatest]);
+        };
+
+        // depth of the opaque packets only; every pass goes through lamp.vs, whose position
+        // matches that of the shading passes exactly
+        auto prepass = [&](unsigned int first, unsigned int last) {
+            lampShader.use();
+            lampShader.setMat4("projection", frame.Projection);
+            lampShader.setMat4("view", frame.View);
+            glBindVertexArray(lightVAO);
+            for (unsigned int k = first; k < last; ++k)
+            {
+                const DrawPacket &packet = *drawOrder[k];
+                if (packet.Instances > 0 || (packet.Group >= 0 && !groupVisible[packet.Group]))
+                    continue;
+                lampShader.setMat4("model", packet.Model);
+                glDrawArrays(GL_TRIANGLES, 0, 36);
+            }
+        };
+
+        // packets are ordered by pass, so the static layer is a prefix of the order
+        unsigned int firstDynamic = std::partition_point(drawOrder.begin(), drawOrder.end(), [](const DrawPacket *packet) {
+            return packet->Pass < PASS_RAIN;
+        }) - drawOrder.begin();
+
+        // boxes, lamp and ground into the bound target; with the prepass their depth is laid down
+        // first and the lit shaders then only run where it is equal, on the visible fragment of
+        // every pixel. The shaded samples are counted to report the overdraw. Returns whether
+        // everything drawn belongs to this view.
+        auto drawStaticLayer = [&]() {
+            bool exact = frame.GpuCulling ? cullGpuBoxes() : true;
+            if (frame.DepthPrepass) {
+                glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                prepass(0, firstDynamic);
+                if (frame.GpuCulling)
+                    drawGpuBoxes(true);
+                glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                glDepthFunc(GL_EQUAL);
+                glDepthMask(GL_FALSE);
+            }
+            bool counting = !shadedPending;
+            if (counting)
+                glBeginQuery(GL_SAMPLES_PASSED, shadedQuery);
+            replay(0, firstDynamic);
+            if (frame.GpuCulling)
+                drawGpuBoxes(false);
+            if (counting) {
+                glEndQuery(GL_SAMPLES_PASSED);
+                shadedPending = true;
+                shadedPixels = (unsigned long long)sceneWidth * sceneHeight;
+                shadedPrepass = frame.DepthPrepass;
+            }
+            glDepthFunc(GL_LESS);
+            glDepthMask(GL_TRUE);
+            queryGroups();
+            return exact;
+        };
 
-        glBindVertexArray(lightVAO);
-        glDrawArrays(GL_TRIANGLES, 0, 36);
+        // render
+        // ------
+        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+        if (frame.CacheStaticLayer) {
+            // the cached layer holds as long as the view, the light, the boxes, the scale and the
+            // occlusion culling are those it was drawn with
+            bool current = staticValid && frame.View == staticView && frame.Projection == staticProjection &&
+                           frame.LightPos == staticLightPos && frame.SceneVersion == staticSceneVersion &&
+                           sceneWidth == staticWidth && sceneHeight == staticHeight && frame.Occlusion == staticOcclusion &&
+                           frame.GpuCulling == staticGpuCulling && frame.DepthPrepass == staticDepthPrepass;
+            if (!current) {
+                glBindFramebuffer(GL_FRAMEBUFFER, staticFBO);
+                glViewport(0, 0, sceneWidth, sceneHeight);
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                // boxes culled for an earlier view are redrawn once the cull catches up
+                staticValid = drawStaticLayer();
+                staticView = frame.View;
+                staticProjection = frame.Projection;
+                staticLightPos = frame.LightPos;
+                staticSceneVersion = frame.SceneVersion;
+                staticOcclusion = frame.Occlusion;
+                staticGpuCulling = frame.GpuCulling;
+                staticDepthPrepass = frame.DepthPrepass;
+                staticWidth = sceneWidth;
+                staticHeight = sceneHeight;
+            }
+            // start the frame from a copy of the cached color and depth, the particles are
+            // depth tested against it
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, staticFBO);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, sceneFBO);
+            glBlitFramebuffer(0, 0, sceneWidth, sceneHeight, 0, 0, sceneWidth, sceneHeight, GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+            glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+            glViewport(0, 0, sceneWidth, sceneHeight);
+        }
+        else {
+            staticValid = false;
+            glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+            glViewport(0, 0, sceneWidth, sceneHeight);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            drawStaticLayer();
+        }
 
+        if (PARTICLE_RESOLUTION_DIVISOR > 1) {
+            int particleWidth = (sceneWidth + PARTICLE_RESOLUTION_DIVISOR - 1) / PARTICLE_RESOLUTION_DIVISOR;
+            int particleHeight = (sceneHeight + PARTICLE_RESOLUTION_DIVISOR - 1) / PARTICLE_RESOLUTION_DIVISOR;
+            glBindFramebuffer(GL_FRAMEBUFFER, particleFBO);
+            glViewport(0, 0, particleWidth, particleHeight);
+
+            // depth only: the nearest scene depth of every block of pixels
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            glDepthFunc(GL_ALWAYS);
+            depthDownsampleShader.use();
+            depthDownsampleShader.setIVec2("sceneMax", sceneWidth - 1, sceneHeight - 1);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, sceneDepth);
+            glBindVertexArray(upscaleVAO);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glDepthFunc(GL_LESS);
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+            // particles over transparent black, color ends up premultiplied by coverage; the
+            // depth is left as the scene's, the upsample compares against it
+            glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+            glDepthMask(GL_FALSE);
+            replay(firstDynamic, drawOrder.size());
+            glDepthMask(GL_TRUE);
+
+            // blend them over the scene color
+            glBindFramebuffer(GL_FRAMEBUFFER, compositeFBO);
+            glViewport(0, 0, sceneWidth, sceneHeight);
+            glDisable(GL_DEPTH_TEST);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+            particleCompositeShader.use();
+            particleCompositeShader.setIVec2("particleMax", particleWidth - 1, particleHeight - 1);
+            particleCompositeShader.setVec2("depthUnproject", frame.Projection[2][2], frame.Projection[3][2]);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, particleColor);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, particleDepth);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, sceneDepth);
+            glBindVertexArray(upscaleVAO);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glActiveTexture(GL_TEXTURE0);
+            glEnable(GL_DEPTH_TEST);
+        }
+        else {
+            replay(firstDynamic, drawOrder.size());
+        }
+        glDepthMask(GL_TRUE);
+        glDisable(GL_BLEND);
+
+        // upscale the drawn part of the offscreen target to the window, filtered bilinearly
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, viewportWidth, viewportHeight);
+        glDisable(GL_DEPTH_TEST);
+        upscaleShader.use();
+        upscaleShader.setVec2("uvScale", (float)sceneWidth / targetWidth, (float)sceneHeight / targetHeight);
+        upscaleShader.setVec2("uvMax", (sceneWidth - 0.5f) / targetWidth, (sceneHeight - 0.5f) / targetHeight);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, sceneColor);
+        glBindVertexArray(upscaleVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glEnable(GL_DEPTH_TEST);
+
+        if (timing) {
+            glEndQuery(GL_TIME_ELAPSED);
+            gpuTimerPending[timer] = true;
+        }
 
-        // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-        // -------------------------------------------------------------------------------
+        // glfw: swap buffers
+        // ------------------
         glfwSwapBuffers(window);
-        glfwWaitEvents();
+
+#ifdef FRAME_ARENA_COUNT_HEAP
+        unsigned long long heapAllocations = EndHeapCheck();
+        if (++renderFrames > HEAP_CHECK_WARMUP_FRAMES && heapAllocations > 0) {
+            LOG_WARN("render thread: {} heap allocations in frame {}, the frame loop should not allocate", heapAllocations, renderFrames);
+        }
+#endif
     }
 
     // optional: de-allocate all resources once they've outlived their purpose:
     // ------------------------------------------------------------------------
     glDeleteVertexArrays(1, &cubeVAO);
+    glDeleteVertexArrays(1, &cullVAO);
+    glDeleteVertexArrays(GPU_CULL_BUFFERS, culledVAO);
+    glDeleteBuffers(1, &boxInstanceVBO);
+    glDeleteBuffers(GPU_CULL_BUFFERS, culledVBO);
+    glDeleteQueries(GPU_CULL_BUFFERS, culledQuery);
+    glDeleteQueries(1, &shadedQuery);
     glDeleteVertexArrays(1, &lightVAO);
+    glDeleteVertexArrays(1, &smokeVAO);
+    glDeleteVertexArrays(1, &rainVAO);
     glDeleteBuffers(1, &VBO);
-
-    // glfw: terminate, clearing all previously allocated GLFW resources.
-    // ------------------------------------------------------------------
-    glfwTerminate();
-    return 0;
+    glDeleteBuffers(1, &quadVBO);
+    glDeleteBuffers(1, &smokeInstanceVBO);
+    glDeleteBuffers(1, &rainInstanceVBO);
+    glDeleteVertexArrays(1, &upscaleVAO);
+    glDeleteFramebuffers(1, &sceneFBO);
+    glDeleteTextures(1, &sceneColor);
+    glDeleteTextures(1, &sceneDepth);
+    glDeleteFramebuffers(1, &staticFBO);
+    glDeleteTextures(1, &staticColor);
+    glDeleteTextures(1, &staticDepth);
+    glDeleteFramebuffers(1, &particleFBO);
+    glDeleteFramebuffers(1, &compositeFBO);
+    glDeleteTextures(1, &particleColor);
+    glDeleteTextures(1, &particleDepth);
+    glDeleteQueries(GPU_TIMER_QUERIES, gpuTimer);
+    if (!groupQuery.empty())
+        glDeleteQueries(groupQuery.size(), groupQuery.data());
+
+    // hand the context back so the main thread can destroy the window
+    glfwMakeContextCurrent(NULL);
 }
 
 // process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
@@ -671,13 +1761,87 @@ void processInput(GLFWwindow *window)
         camera.ProcessKeyboard(RIGHT, deltaTime);
 }
 
+// glfw: whenever a key is pressed, this callback is called; used for toggles rather than held keys
+// ---------------------------------------------------------------------------------------------
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    if (action != GLFW_PRESS)
+        return;
+
+    if (key == GLFW_KEY_F)
+        smokeFluidEnabled = !smokeFluidEnabled;
+    if (key == GLFW_KEY_P)
+        simulationPaused = !simulationPaused;
+    if (key == GLFW_KEY_O) {
+        occlusionMode = (OcclusionMode)((occlusionMode + 1) % OCCLUSION_MODES);
+        LOG_INFO("occlusion culling: {}", OCCLUSION_MODE_NAMES[occlusionMode]);
+    }
+    if (key == GLFW_KEY_C) {
+        staticLayerCache = !staticLayerCache;
+        LOG_INFO("static layer cache: {}", staticLayerCache ? "on" : "off");
+    }
+    if (key == GLFW_KEY_V) {
+        pvsEnabled = !pvsEnabled;
+        LOG_INFO("potentially visible sets: {}", pvsEnabled ? "on" : "off");
+    }
+    if (key == GLFW_KEY_Z) {
+        depthPrepass = !depthPrepass;
+        LOG_INFO("depth prepass: {}", depthPrepass ? "on" : "off");
+    }
+    if (key == GLFW_KEY_G) {
+        gpuCulling = !gpuCulling;
+        LOG_INFO("box culling: {}", gpuCulling ? "gpu" : "cpu");
+    }
+
+    if (key >= GLFW_KEY_1 && key <= GLFW_KEY_4) {
+        framePacer.SetMode((PacingMode)(PACING_UNCAPPED + key - GLFW_KEY_1));
+        LOG_INFO("frame pacing: {}", framePacer.ModeName());
+    }
+}
+
+// glfw: whenever a mouse button is pressed, this callback is called
+// ---------------------------------------------------------------------------------------------
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+        pickRequested = true;
+}
+
+// smoke: (re)initialise a particle leaving the emitter at origin
+// ---------------------------------------------------------------------------------------------
+void spawnSmoke(smoke &particle, glm::vec3 origin)
+{
+    particle.x = origin.x;
+    particle.y = origin.y;
+    particle.z = origin.z;
+    particle.prev_x = origin.x;
+    particle.prev_y = origin.y;
+    particle.prev_z = origin.z;
+    particle.decaytime = rand()%(SMOKE_MAX_LIFETIME + 1);
+    particle.halftime = particle.decaytime / 2;
+    particle.x_speed = static_cast<float>(-PARTICLE_SPEED + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (PARTICLE_SPEED * 2))));
+    particle.y_speed = static_cast<float>(PARTICLE_MIN_SPEED + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (PARTICLE_MAX_SPEED - PARTICLE_MIN_SPEED))));
+    particle.z_speed = static_cast<float>(PARTICLE_MIN_SPEED + static_cast <float> (rand()) / ( static_cast <float> (RAND_MAX / (PARTICLE_MAX_SPEED - PARTICLE_MIN_SPEED))));
+}
+
+// xorshift generator for worker threads, which must not share rand()'s hidden state
+// ---------------------------------------------------------------------------------------------
+float randomFloat(unsigned int &state, float min, float max)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return min + (max - min) * (state >> 8) * (1.0f / 16777216.0f);
+}
+
 // glfw: whenever the window size changed (by OS or user resize) this callback function executes
 // ---------------------------------------------------------------------------------------------
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
-    // make sure the viewport matches the new window dimensions; note that width and
-    // height will be significantly larger than specified on retina displays.
-    glViewport(0, 0, width, height);
+    // the context lives on the render thread, the new size reaches it with the next snapshot
+    framebufferWidth = width;
+    framebufferHeight = height;
+    camera.SetViewport(width, height);
 }
 
 